@@ -5,32 +5,51 @@
 #include "nvs_flash.h"
 #include "mimi_camera.h"
 #include "mimi_common.h"
+#include "mimi_config.h"
+#include "mimi_frame_bus.h"
+#include "mimi_sched.h"
 #include "mimi_webserver.h"
 #include "mimi_wifi.h"
 #include "mimi_uart.h"
 
 void app_main(void) {
     ESP_LOGI(TAG_MIMI, "Startup...");
+    boot_mark("app_main");
     esp_err_t ret = nvs_flash_init();
     if (ret == ESP_ERR_NVS_NO_FREE_PAGES || ret == ESP_ERR_NVS_NEW_VERSION_FOUND) {
         ESP_ERROR_CHECK(nvs_flash_erase());
         ret = nvs_flash_init();
     }
     ESP_ERROR_CHECK(ret);
+    sched_init();
+    config_store_init();
+    const mimi_config_t *config = config_store_get();
 
+    // Association runs in the background while the sensor, the frame pool and the encoder come up
     ESP_LOGI(TAG_MIMI, "Initializing WiFi connection...");
-    init_wifi();
+    init_wifi(config->ssid, config->password);
+    boot_mark("Wi-Fi started");
 
     ESP_LOGI(TAG_MIMI, "Initializing camera...");
-    ESP_ERROR_CHECK(init_camera());
+    ESP_ERROR_CHECK(init_camera(&config->video_mode));
     ESP_LOGI(TAG_MIMI, "Initializing camera...done");
+    boot_mark("sensor initialized");
 
-    frame_queue = xQueueCreate(JPEG_FRAME_POOL_SIZE, sizeof(jpeg_frame_t *));
-    xTaskCreatePinnedToCore(camera_task, "camera_task", 4096, NULL, CAMERA_TASK_PRIORITY, NULL, CAMERA_TASK_CORE_ID);
-    start_webserver();
+    frame_bus_init();
+    TaskHandle_t camera_task_handle = NULL;
+    xTaskCreatePinnedToCore(camera_task, "camera_task", 4096, NULL, sched_priority(SCHED_ROLE_CAMERA),
+                            &camera_task_handle, sched_core(SCHED_ROLE_CAMERA));
+    sched_register_task(camera_task_handle, SCHED_ROLE_CAMERA);
 
     init_uart();
-    xTaskCreatePinnedToCore(uart_task, "uart_task", 2048, NULL, UART_TASK_PRIORITY, NULL, UART_TASK_CORE_ID);
+    TaskHandle_t uart_task_handle = NULL;
+    xTaskCreatePinnedToCore(uart_task, "uart_task", 3072, NULL, sched_priority(SCHED_ROLE_UART), &uart_task_handle,
+                            sched_core(SCHED_ROLE_UART));
+    sched_register_task(uart_task_handle, SCHED_ROLE_UART);
+
+    wifi_wait_connected(portMAX_DELAY);
+    start_webserver();
+    boot_mark("web server started");
 
     ESP_LOGI(TAG_MIMI, "Free heap: %lu", esp_get_free_heap_size());
     ESP_LOGI(TAG_MIMI, "Free PSRAM: %u", heap_caps_get_free_size(MALLOC_CAP_SPIRAM));
@@ -1,18 +1,27 @@
 #include "mimi_camera.h"
 
+#include <inttypes.h>
 #include <string.h>
 
-#include "esp_heap_caps.h"
+#include "esp_timer.h"
 #include "esp_jpeg_enc.h"
 #include "mimi_common.h"
+#include "mimi_frame_bus.h"
+#include "mimi_gc2145.h"
+#include "mimi_metrics.h"
+#include "mimi_motion.h"
+#include "mimi_rate_control.h"
+#include "mimi_sched.h"
+#include "mimi_yuv.h"
 #include "esp_log.h"
+#include "driver/gpio.h"
 #include "FreeRTOSConfig.h"
 #include "portmacro.h"
 #include "sccb.h"
 #include "freertos/projdefs.h"
 #include "freertos/queue.h"
+#include "freertos/semphr.h"
 
-#define CAM_GC2145_ADDR 0x3C
 #define CAM_REGISTER_0x17 0x17
 #define CAM_PIN_PWDN 38
 #define CAM_PIN_RESET (-1)   //software reset will be performed
@@ -31,10 +40,141 @@
 #define CAM_PIN_D6 17
 #define CAM_PIN_D7 16
 
-#define MAX_JPEG_SIZE (200 * 1024)
+#define FPS_LIMIT_TOLERANCE_US 2000 // Sensor frame timing jitter, a frame this early still passes the fps limit
+#define JPEG_INPUT_ALIGNMENT 16
+#define CAMERA_STATS_LOG_INTERVAL 100 // frames
+#define CAPTURE_RETRY_MS 100 // Back-off after a failed capture, reconfigure and demand requests end it early
+#define CAMERA_ENCODER_COUNT (CAMERA_DUAL_ENCODER ? 2 : 1)
+#define ENCODER_TASK_STACK_SIZE 4096
 
-static jpeg_frame_t jpeg_pool[JPEG_FRAME_POOL_SIZE];
-static int jpeg_pool_index = 0;
+typedef struct {
+    jpeg_enc_handle_t handle;
+    jpeg_pixel_format_t src_type; // JPEG_PIXEL_FORMAT_YCbY2YCrY2: frames are converted to 4:2:0 before encoding
+    uint8_t quality;
+    int block_size;          // Stripe size for the low-latency mode, 0 if the stripes can't be used
+    // Aligned copy of the camera frame. Allocated on first use only: with CAMERA_ZERO_COPY the encoder reads
+    // framebuffers directly and this buffer is needed only for a framebuffer that is not 16-byte aligned, a
+    // region of interest narrower than the frame, or a frame converted to 4:2:0.
+    uint8_t *aligned_in_buf;
+    QueueHandle_t jobs;      // capture_job_t, dual-encoder mode only
+} camera_encoder_t;
+
+typedef struct {
+    camera_fb_t *fb;
+    int64_t capture_time;
+    uint32_t seq;
+} capture_job_t;
+
+typedef struct {
+    jpeg_frame_t *jpeg_frame; // NULL if encoding failed
+    int64_t capture_time;
+    int64_t encoded_time;
+    int64_t published_time;   // Non-zero if the frame was published during encoding (low-latency mode)
+    int64_t copy_us;
+    bool copied;
+} encode_result_t;
+
+typedef struct {
+    uint16_t width;
+    uint16_t height;
+    framesize_t frame_size;
+} camera_resolution_t;
+
+// Sensor modes the pipeline can be switched to. Larger ones need more PSRAM for framebuffers and JPEG frames.
+static const camera_resolution_t camera_resolutions[] = {
+    {160, 120, FRAMESIZE_QQVGA},
+    {240, 240, FRAMESIZE_240X240},
+    {320, 240, FRAMESIZE_QVGA},
+    {320, 320, FRAMESIZE_320X320},
+    {480, 320, FRAMESIZE_HVGA},
+};
+
+// Region of interest sizes the sensor can crop to itself (CAMERA_SENSOR_WINDOWING): the driver sizes frames by
+// framesize_t, so the region must have the size of one
+static const camera_resolution_t sensor_window_sizes[] = {
+    {96, 96, FRAMESIZE_96X96},
+    {128, 128, FRAMESIZE_128X128},
+    {176, 144, FRAMESIZE_QCIF},
+    {240, 176, FRAMESIZE_HQVGA},
+    {240, 240, FRAMESIZE_240X240},
+    {320, 240, FRAMESIZE_QVGA},
+    {320, 320, FRAMESIZE_320X320},
+};
+
+typedef struct {
+    uint32_t id;
+    uint8_t quality;
+} still_request_t;
+
+typedef struct {
+    uint32_t id;
+    jpeg_frame_t *frame;      // NULL if encoding failed
+} still_result_t;
+
+static camera_encoder_t encoders[CAMERA_ENCODER_COUNT];
+
+// One-shot encodes for camera_capture_still(), the encoder is opened on the first request
+static camera_encoder_t still_encoder;
+static QueueHandle_t still_requests;
+static QueueHandle_t still_results;
+static SemaphoreHandle_t still_mutex;
+static uint32_t next_still_id;
+
+// Owned by the camera task, changed between frames only (camera_reconfigure())
+static camera_video_mode_t video_mode = {
+    .width = 320,
+    .height = 320,
+    .quality = 0,
+    .subsampling = JPEG_SUBSAMPLE_422,
+    .max_fps = 0,
+    .convert_420 = false,
+};
+// Demand-driven capture (CAMERA_DEMAND_DRIVEN). The sensor state is owned by the camera task.
+static TaskHandle_t camera_task_handle;
+static bool sensor_running = true;
+static bool sensor_windowed;              // The sensor outputs the region of interest only, no software crop
+static volatile uint32_t sensor_fps;      // Frames delivered by the driver in the last second
+static uint32_t sensor_fps_frames;
+static int64_t sensor_fps_start_time;
+static int64_t last_demand_time;
+static int64_t idle_since;
+static int64_t wake_time;                 // Set on a wakeup until the first frame is published
+static int skip_frames;                  // Dropped after a wakeup (exposure settling) or a window change
+static bool first_frame_published;       // For the boot timeline
+static portMUX_TYPE power_stats_mux = portMUX_INITIALIZER_UNLOCKED;
+static camera_power_stats_t power_stats = {.active = true};
+
+static volatile bool benchmark_requested;
+static QueueHandle_t benchmark_results;
+
+static QueueHandle_t reconfigure_requests;
+static QueueHandle_t reconfigure_results;
+static SemaphoreHandle_t reconfigure_mutex;
+
+#if CAMERA_DUAL_ENCODER
+// Frames are encoded in parallel but published strictly in capture order
+static SemaphoreHandle_t reorder_mutex;
+static encode_result_t reorder_results[CAMERA_ENCODER_COUNT];
+static bool reorder_ready[CAMERA_ENCODER_COUNT];
+static TaskHandle_t reorder_waiters[CAMERA_ENCODER_COUNT];
+static uint32_t next_publish_seq = 0;
+#endif
+
+static volatile bool low_latency_mode = CAMERA_LOW_LATENCY_MODE;
+
+#if CAMERA_DUAL_ENCODER
+static SemaphoreHandle_t encoders_flushed;
+#endif
+
+typedef struct {
+    uint32_t frames;
+    uint32_t copied_frames;
+    int64_t capture_to_encoded_us;
+    int64_t capture_to_published_us;
+    int64_t copy_us;
+} camera_stats_t;
+
+static camera_stats_t camera_stats;
 
 static camera_config_t camera_config = {
     .pin_pwdn = CAM_PIN_PWDN,
@@ -60,18 +200,49 @@ static camera_config_t camera_config = {
     .ledc_channel = LEDC_CHANNEL_0,
 
     .pixel_format = PIXFORMAT_YUV422, //YUV422,GRAYSCALE,RGB565,JPEG
-    // .frame_size = FRAMESIZE_HVGA,    //QQVGA-UXGA, For ESP32, do not use sizes above QVGA when not JPEG. The performance of the ESP32-S series has improved a lot, but JPEG mode always gives better frame rates.
-    .frame_size = FRAMESIZE_320X320,    //QQVGA-UXGA, For ESP32, do not use sizes above QVGA when not JPEG. The performance of the ESP32-S series has improved a lot, but JPEG mode always gives better frame rates.
-    // .frame_size = FRAMESIZE_QVGA,    //QQVGA-UXGA, For ESP32, do not use sizes above QVGA when not JPEG. The performance of the ESP32-S series has improved a lot, but JPEG mode always gives better frame rates.
-    // .frame_size = FRAMESIZE_QQVGA,    //QQVGA-UXGA, For ESP32, do not use sizes above QVGA when not JPEG. The performance of the ESP32-S series has improved a lot, but JPEG mode always gives better frame rates.
+    .frame_size = FRAMESIZE_320X320,    //Initial video_mode, see camera_resolutions for the others
 
     .jpeg_quality = 12, //0-63, for OV series camera sensors, lower number means higher quality
-    .fb_count = 2,       //When jpeg mode is used, if fb_count more than one, the driver will work in continuous mode.
+    .fb_count = CAMERA_ENCODER_COUNT + 1, //Encoders hold their framebuffers while the next frame is captured. When jpeg mode is used, if fb_count more than one, the driver will work in continuous mode.
     .fb_location = CAMERA_FB_IN_PSRAM,
     .grab_mode = CAMERA_GRAB_WHEN_EMPTY,
 };
 
-esp_err_t init_camera(void) {
+static const camera_resolution_t *find_in(const camera_resolution_t *table, const size_t count,
+                                          const uint16_t width, const uint16_t height) {
+    for (size_t i = 0; i < count; i++) {
+        if (table[i].width == width && table[i].height == height) {
+            return &table[i];
+        }
+    }
+    return NULL;
+}
+
+static const camera_resolution_t *find_resolution(const uint16_t width, const uint16_t height) {
+    return find_in(camera_resolutions, sizeof(camera_resolutions) / sizeof(camera_resolutions[0]), width, height);
+}
+
+static bool sensor_can_crop(const camera_video_mode_t *mode) {
+    return CAMERA_SENSOR_WINDOWING && mode->roi.width != 0 &&
+           find_in(sensor_window_sizes, sizeof(sensor_window_sizes) / sizeof(sensor_window_sizes[0]),
+                   mode->roi.width, mode->roi.height) != NULL;
+}
+
+/**
+ * Picks the sensor frame size for the video mode: the region of interest's if the sensor can crop to it,
+ * otherwise the mode's own. Takes effect on the next start_sensor().
+ */
+static void select_frame_size(void) {
+    sensor_windowed = sensor_can_crop(&video_mode);
+    const camera_resolution_t *size =
+        sensor_windowed ? find_in(sensor_window_sizes, sizeof(sensor_window_sizes) / sizeof(sensor_window_sizes[0]),
+                                  video_mode.roi.width, video_mode.roi.height)
+                        : find_resolution(video_mode.width, video_mode.height);
+    camera_config.frame_size = size->frame_size;
+}
+
+
+static esp_err_t start_sensor(void) {
     const esp_err_t err = esp_camera_init(&camera_config);
     if (err != ESP_OK) {
         ESP_LOGE(TAG_MIMI, "Camera init failed with error 0x%x", err);
@@ -79,90 +250,915 @@ esp_err_t init_camera(void) {
     }
 
     // Rotate 180:
-    uint8_t reg = SCCB_Read(CAM_GC2145_ADDR, CAM_REGISTER_0x17);
+    uint8_t reg = SCCB_Read(GC2145_SCCB_ADDR, CAM_REGISTER_0x17);
     reg |= 0x03;
-    SCCB_Write(CAM_GC2145_ADDR, CAM_REGISTER_0x17, reg);
+    SCCB_Write(GC2145_SCCB_ADDR, CAM_REGISTER_0x17, reg);
 
+    if (sensor_windowed) {
+        const camera_resolution_t *mode = find_resolution(video_mode.width, video_mode.height);
+        if (gc2145_set_window(mode->frame_size, mode->width, mode->height, &video_mode.roi, true) != ESP_OK) {
+            esp_camera_deinit();
+            return ESP_FAIL;
+        }
+    }
     return ESP_OK;
 }
 
-void camera_task(void *)
-{
+esp_err_t init_camera(const camera_video_mode_t *mode) {
+    if (mode != NULL && find_resolution(mode->width, mode->height) != NULL && mode->quality <= 100) {
+        video_mode = *mode;
+        video_mode.roi = (camera_roi_t){0};
+    } else if (mode != NULL) {
+        ESP_LOGW(TAG_MIMI, "Unsupported video mode %dx%d, starting with %dx%d", mode->width, mode->height,
+                 video_mode.width, video_mode.height);
+    }
+    const esp_err_t err = start_sensor();
+    if (err != ESP_OK) {
+        return err;
+    }
+
+    reconfigure_requests = xQueueCreate(1, sizeof(camera_video_mode_t));
+    reconfigure_results = xQueueCreate(1, sizeof(esp_err_t));
+    reconfigure_mutex = xSemaphoreCreateMutex();
+    still_requests = xQueueCreate(1, sizeof(still_request_t));
+    still_results = xQueueCreate(1, sizeof(still_result_t));
+    still_mutex = xSemaphoreCreateMutex();
+    benchmark_results = xQueueCreate(1, sizeof(camera_yuv420_benchmark_t));
+    return ESP_OK;
+}
+
+void camera_set_low_latency_mode(const bool enabled) {
+    low_latency_mode = enabled;
+    ESP_LOGI(TAG_MIMI, "Low-latency (stripe) encoding %s", enabled ? "enabled" : "disabled");
+}
+
+bool camera_get_low_latency_mode(void) {
+    return low_latency_mode;
+}
+
+/**
+ * Requests are served even while the sensor is idle: the camera task sleeps on its notifications then.
+ */
+static void wake_camera_task(void) {
+    if (camera_task_handle != NULL) {
+        xTaskNotifyGive(camera_task_handle);
+    }
+}
+
+/**
+ * Size of a raw YUV422 frame of the current mode: the aligned encoder input, and room enough for its JPEG at
+ * any usable quality.
+ */
+static size_t frame_buffer_size(void) {
+    return (size_t)video_mode.width * video_mode.height * 2;
+}
+
+/**
+ * Size of the encoded image: the region of interest, or the whole frame without one.
+ */
+static uint16_t encoded_width(void) {
+    return video_mode.roi.width != 0 ? video_mode.roi.width : video_mode.width;
+}
+
+static uint16_t encoded_height(void) {
+    return video_mode.roi.width != 0 ? video_mode.roi.height : video_mode.height;
+}
+
+/**
+ * Returns a 16-byte aligned buffer with the image to encode for jpeg_enc_process(), and its length. Without a
+ * region of interest (or with one the sensor crops itself), or with one spanning whole rows, the image is a
+ * contiguous part of the framebuffer, which is passed on in place when it is aligned (esp32-camera aligns PSRAM
+ * framebuffers for DMA on ESP32-S3). Otherwise the image is copied, a narrower region row by row, or converted
+ * to 4:2:0 for an encoder that takes JPEG_PIXEL_FORMAT_YCbY2YCrY2.
+ * The framebuffer must not be returned to the driver until encoding is finished.
+ */
+static const uint8_t *get_encoder_input(camera_encoder_t *encoder, const camera_fb_t *fb, int *in_len,
+                                        int64_t *copy_us) {
+    *copy_us = 0;
+    const camera_roi_t *roi = &video_mode.roi;
+    const size_t stride = fb->width * 2;
+    const uint8_t *src = fb->buf;
+    int width = (int)fb->width;
+    int height = (int)fb->height;
+    bool contiguous = true;
+    if (fb->len < stride * fb->height) {
+        ESP_LOGE(TAG_MIMI, "Camera frame is truncated (%u bytes)", fb->len);
+        return NULL;
+    }
+    if (roi->width != 0 && !sensor_windowed) {
+        if (roi->x + roi->width > fb->width || roi->y + roi->height > fb->height) {
+            ESP_LOGE(TAG_MIMI, "Region of interest is outside the %ux%u camera frame", fb->width, fb->height);
+            return NULL;
+        }
+        src += roi->y * stride + roi->x * 2;
+        width = roi->width;
+        height = roi->height;
+        contiguous = roi->width == fb->width;
+    }
+    const bool convert = encoder->src_type == JPEG_PIXEL_FORMAT_YCbY2YCrY2;
+    *in_len = convert ? width * height * 3 / 2 : width * height * 2;
+
+#if CAMERA_ZERO_COPY
+    if (!convert && contiguous && ((uintptr_t)src & (JPEG_INPUT_ALIGNMENT - 1)) == 0) {
+        return src;
+    }
+#endif
+    if ((size_t)*in_len > frame_buffer_size() || (convert && ((uintptr_t)src & 3) != 0)) {
+        ESP_LOGE(TAG_MIMI, "Camera frame can't be copied (%d bytes at %p)", *in_len, src);
+        return NULL;
+    }
+    if (encoder->aligned_in_buf == NULL) {
+        encoder->aligned_in_buf = jpeg_calloc_align(frame_buffer_size(), JPEG_INPUT_ALIGNMENT);
+        if (encoder->aligned_in_buf == NULL) {
+            ESP_LOGE(TAG_MIMI, "Failed to allocate aligned encoder input buffer");
+            return NULL;
+        }
+    }
+    const int64_t copy_start = esp_timer_get_time();
+    if (convert) {
+        yuv422_to_yuv420(src, stride, width, height, encoder->aligned_in_buf);
+    } else if (contiguous) {
+        memcpy(encoder->aligned_in_buf, src, *in_len);
+    } else {
+        const size_t row_len = width * 2;
+        for (int row = 0; row < height; row++) {
+            memcpy(encoder->aligned_in_buf + row * row_len, src + row * stride, row_len);
+        }
+    }
+    *copy_us = esp_timer_get_time() - copy_start;
+    if (convert) {
+        metrics_record(METRIC_STAGE_CONVERT, *copy_us);
+    }
+    return encoder->aligned_in_buf;
+}
+
+/**
+ * Encodes the frame MCU stripe by MCU stripe with jpeg_enc_process_with_block(). The frame is published after the
+ * first stripe and subscribers are woken up after every next one, so JPEG bytes go to the socket while the rest
+ * of the frame is still being encoded. `published_time` is set when the frame is published.
+ */
+static jpeg_error_t encode_in_stripes(const camera_encoder_t *encoder, const uint8_t *in_buf, const int in_len,
+                                      jpeg_frame_t *jpeg_frame, int *jpeg_len, int64_t *published_time) {
+    jpeg_error_t ret = JPEG_ERR_FAIL;
+    for (int offset = 0; offset + encoder->block_size <= in_len; offset += encoder->block_size) {
+        ret = jpeg_enc_process_with_block(encoder->handle, in_buf + offset, encoder->block_size,
+                                          jpeg_frame->fb.buf, (int)jpeg_frame->buf_size, jpeg_len);
+        if (ret < JPEG_ERR_OK || ret == JPEG_ERR_OK) {
+            break; // Failed or finished the image
+        }
+        if (*published_time == 0) {
+            *published_time = esp_timer_get_time();
+            jpeg_frame->publish_time = *published_time;
+            frame_pool_mark_streaming(jpeg_frame, *jpeg_len);
+            frame_bus_publish(jpeg_frame);
+            metrics_count(METRIC_COUNTER_FRAMES_PUBLISHED);
+        } else {
+            frame_pool_set_encoded_len(jpeg_frame, *jpeg_len);
+            frame_bus_notify_progress();
+        }
+    }
+    return ret;
+}
+
+static void update_camera_stats(const int64_t capture_to_encoded_us, const int64_t capture_to_published_us,
+                                const int64_t copy_us, const bool copied) {
+    camera_stats.frames++;
+    camera_stats.capture_to_encoded_us += capture_to_encoded_us;
+    camera_stats.capture_to_published_us += capture_to_published_us;
+    if (copied) {
+        camera_stats.copied_frames++;
+        camera_stats.copy_us += copy_us;
+    }
+    if (camera_stats.frames < CAMERA_STATS_LOG_INTERVAL) {
+        return;
+    }
+    ESP_LOGI(TAG_MIMI, "Capture-to-encoded: avg %" PRIu32 " us, capture-to-published: avg %" PRIu32 " us "
+                       "over %" PRIu32 " frames (zero-copy: %" PRIu32 ", copied: %" PRIu32 ", avg copy: %" PRIu32 " us)",
+             (uint32_t)(camera_stats.capture_to_encoded_us / camera_stats.frames),
+             (uint32_t)(camera_stats.capture_to_published_us / camera_stats.frames), camera_stats.frames,
+             camera_stats.frames - camera_stats.copied_frames, camera_stats.copied_frames,
+             camera_stats.copied_frames > 0 ? (uint32_t)(camera_stats.copy_us / camera_stats.copied_frames) : 0);
+    frame_pool_stats_t pool_stats;
+    frame_pool_get_stats(&pool_stats);
+    ESP_LOGI(TAG_MIMI, "JPEG frame pool: %" PRIu32 " acquired, %" PRIu32 " exhausted, %" PRIu32 "/%d in use (max %" PRIu32 ")",
+             pool_stats.acquired, pool_stats.exhausted, pool_stats.in_use, JPEG_FRAME_POOL_SIZE, pool_stats.max_in_use);
+    rate_control_state_t rate_control;
+    rate_control_get_state(&rate_control);
+    ESP_LOGI(TAG_MIMI, "Rate control: quality %d, frame %" PRIu32 " bytes, budget %" PRIu32 " bytes, throughput %" PRIu32 " kbps",
+             rate_control.quality, rate_control.frame_bytes, rate_control.budget_bytes, rate_control.throughput_kbps);
+    camera_stats = (camera_stats_t){0};
+}
+
+static esp_err_t open_jpeg_encoder(camera_encoder_t *encoder, const jpeg_pixel_format_t src_type,
+                                   const jpeg_subsampling_t subsampling, const uint8_t quality,
+                                   const bool task_enable, const int core_id) {
     jpeg_enc_config_t enc_cfg = {
-        // // HVGA:
-        // .width = 480,
-        // .height = 320,
-        // 320x320:
-        .width = 320,
-        .height = 320,
-        // // QVGA:
-        // .width = 320,
-        // .height = 240,
-        // // QQVGA:
-        // .width = 160,
-        // .height = 120,
-        .src_type = JPEG_PIXEL_FORMAT_YCbYCr,
-        .subsampling = JPEG_SUBSAMPLE_422,
-        // .subsampling = JPEG_SUBSAMPLE_GRAY,
-        .quality = 10,
+        .width = encoded_width(),
+        .height = encoded_height(),
+        .src_type = src_type,
+        .subsampling = subsampling,
+        .quality = quality,
         .rotate = JPEG_ROTATE_0D,
-        .task_enable = true,
-        .hfm_task_priority = ENCODING_TASK_PRIORITY,
-        .hfm_task_core = ENCODING_TASK_CORE_ID
+        .task_enable = task_enable,
+        .hfm_task_priority = sched_priority(SCHED_ROLE_ENCODING),
+        .hfm_task_core = core_id
     };
 
-    // Initialize JPEG frame pool
-    for (int i = 0; i < JPEG_FRAME_POOL_SIZE; i++) {
-        jpeg_pool[i].in_buf = jpeg_calloc_align(MAX_JPEG_SIZE, 16);
-        jpeg_pool[i].fb.buf = heap_caps_malloc(MAX_JPEG_SIZE, MALLOC_CAP_SPIRAM);
-        jpeg_pool[i].fb.len = 0;
-        jpeg_pool[i].fb.width = 0;
-        jpeg_pool[i].fb.height = 0;
-        jpeg_pool[i].fb.format = PIXFORMAT_JPEG;
+    if (jpeg_enc_open(&enc_cfg, &encoder->handle) != JPEG_ERR_OK) {
+        ESP_LOGE(TAG_MIMI, "jpeg_enc_open() failed");
+        return ESP_FAIL;
     }
+    encoder->src_type = src_type;
+    encoder->quality = quality;
 
-    jpeg_enc_handle_t jpeg_enc = NULL;
-    if (jpeg_enc_open(&enc_cfg, &jpeg_enc) != JPEG_ERR_OK) {
-        ESP_LOGE(TAG_MIMI, "jpeg_enc_open() failed");
-        vTaskDelete(NULL);
+    // Stripes are passed to the encoder in place, so each must start 16-byte aligned
+    const int block_size = jpeg_enc_get_block_size(encoder->handle);
+    encoder->block_size = block_size > 0 && block_size % JPEG_INPUT_ALIGNMENT == 0 ? block_size : 0;
+    if (encoder->block_size == 0) {
+        ESP_LOGW(TAG_MIMI, "Encoder block size %d is not usable, low-latency mode is not available", block_size);
+    }
+    return ESP_OK;
+}
+
+static esp_err_t open_encoder(camera_encoder_t *encoder, const bool task_enable, const int core_id) {
+    const bool convert = video_mode.convert_420 && video_mode.subsampling == JPEG_SUBSAMPLE_420 &&
+                         yuv420_convertible(encoded_width(), encoded_height());
+    return open_jpeg_encoder(encoder, convert ? JPEG_PIXEL_FORMAT_YCbY2YCrY2 : JPEG_PIXEL_FORMAT_YCbYCr,
+                             video_mode.subsampling,
+                             video_mode.quality != 0 ? video_mode.quality : RATE_CONTROL_INITIAL_QUALITY,
+                             task_enable, core_id);
+}
+
+static esp_err_t open_encoders(void) {
+    for (int i = 0; i < CAMERA_ENCODER_COUNT; i++) {
+        // Dual-encoder mode: no Huffman helper task, every core runs a whole encoder of its own
+        const esp_err_t err = CAMERA_DUAL_ENCODER ? open_encoder(&encoders[i], false, i)
+                                                  : open_encoder(&encoders[i], true, sched_core(SCHED_ROLE_ENCODING));
+        if (err != ESP_OK) {
+            return err;
+        }
+    }
+    return ESP_OK;
+}
+
+static void close_encoder(camera_encoder_t *encoder) {
+    if (encoder->handle != NULL) {
+        jpeg_enc_close(encoder->handle);
+        encoder->handle = NULL;
+    }
+    if (encoder->aligned_in_buf != NULL) { // Sized for the previous mode
+        jpeg_free_align(encoder->aligned_in_buf);
+        encoder->aligned_in_buf = NULL;
+    }
+}
+
+/**
+ * Encodes a camera frame into a frame from the pool and returns the framebuffer to the driver.
+ * Unless encoded in stripes, the frame is not published yet. Returns false if the frame was dropped.
+ */
+static bool encode_frame(camera_encoder_t *encoder, camera_fb_t *fb, const int64_t capture_time,
+                         const bool stripes, encode_result_t *result) {
+    jpeg_frame_t *jpeg_frame = frame_pool_acquire();
+    if (jpeg_frame == NULL) {
+        ESP_LOGD(TAG_MIMI, "All JPEG frames are in use, dropping camera frame");
+        esp_camera_fb_return(fb);
+        return false;
+    }
+
+    int in_len = 0;
+    int64_t copy_us;
+    const uint8_t *in_buf = get_encoder_input(encoder, fb, &in_len, &copy_us);
+    if (in_buf == NULL) {
+        esp_camera_fb_return(fb);
+        jpeg_frame_release(jpeg_frame);
+        return false;
+    }
+
+    jpeg_frame->fb.width = encoded_width();
+    jpeg_frame->fb.height = encoded_height();
+    jpeg_frame->capture_time = capture_time;
+
+    const uint8_t next_quality = video_mode.quality != 0 ? video_mode.quality
+                                                         : rate_control_next_quality(frame_bus_max_queued());
+    if (next_quality != encoder->quality && jpeg_enc_set_quality(encoder->handle, next_quality) == JPEG_ERR_OK) {
+        encoder->quality = next_quality;
+    }
+
+    int jpeg_len = 0;
+    int64_t published_time = 0;
+    const int64_t encode_start_time = esp_timer_get_time();
+    metrics_record(METRIC_STAGE_PRE_ENCODE, encode_start_time - capture_time);
+    jpeg_error_t jret;
+    if (stripes && encoder->block_size > 0) {
+        jret = encode_in_stripes(encoder, in_buf, in_len, jpeg_frame, &jpeg_len, &published_time);
+    } else {
+        jret = jpeg_enc_process(
+            encoder->handle,
+            in_buf, in_len,
+            jpeg_frame->fb.buf, (int)jpeg_frame->buf_size,
+            &jpeg_len
+        );
+    }
+    const int64_t encoded_time = esp_timer_get_time();
+
+    esp_camera_fb_return(fb); // Not earlier: in zero-copy mode the encoder reads the framebuffer itself
+
+    if (jret != JPEG_ERR_OK || jpeg_len <= 0) {
+        ESP_LOGE(TAG_MIMI, "JPEG encoding failed (%d)", jret);
+        metrics_count(METRIC_COUNTER_ENCODE_FAILED);
+        if (published_time != 0) {
+            // Subscribers are already sending it: let them know the frame is incomplete
+            jpeg_frame->fb.len = 0;
+            frame_pool_mark_published(jpeg_frame);
+            frame_bus_notify_progress();
+        }
+        jpeg_frame_release(jpeg_frame);
+        return false;
+    }
+
+    jpeg_frame->fb.len = jpeg_len;
+    frame_pool_mark_published(jpeg_frame);
+    rate_control_on_frame_encoded(jpeg_len);
+    metrics_record(METRIC_STAGE_ENCODE, encoded_time - encode_start_time);
+
+    *result = (encode_result_t){
+        .jpeg_frame = jpeg_frame,
+        .capture_time = capture_time,
+        .encoded_time = encoded_time,
+        .published_time = published_time,
+        .copy_us = copy_us,
+        .copied = in_buf == encoder->aligned_in_buf,
+    };
+    return true;
+}
+
+/**
+ * Hands an encoded frame to the subscribers (or tells them a streamed frame is complete) and drops the encoder's
+ * reference to it.
+ */
+static void publish_frame(encode_result_t *result) {
+    jpeg_frame_t *jpeg_frame = result->jpeg_frame;
+    if (result->published_time == 0) {
+        result->published_time = esp_timer_get_time();
+        jpeg_frame->publish_time = result->published_time;
+        frame_bus_publish(jpeg_frame);
+        metrics_count(METRIC_COUNTER_FRAMES_PUBLISHED);
+        metrics_record(METRIC_STAGE_PUBLISH, esp_timer_get_time() - result->encoded_time);
+    } else {
+        frame_bus_notify_progress();
+    }
+    update_camera_stats(result->encoded_time - result->capture_time, result->published_time - result->capture_time,
+                        result->copy_us, result->copied);
+
+    frame_bus_set_latest(jpeg_frame);
+    jpeg_frame_release(jpeg_frame);
+
+    if (!first_frame_published) {
+        first_frame_published = true;
+        boot_mark("first frame");
+    }
+
+    if (wake_time != 0) {
+        const uint32_t time_to_first_frame_ms = (uint32_t)((result->published_time - wake_time) / 1000);
+        wake_time = 0;
+        portENTER_CRITICAL(&power_stats_mux);
+        power_stats.time_to_first_frame_ms = time_to_first_frame_ms;
+        portEXIT_CRITICAL(&power_stats_mux);
+        ESP_LOGI(TAG_MIMI, "First frame %" PRIu32 " ms after wakeup", time_to_first_frame_ms);
+    }
+}
+
+static jpeg_frame_t *encode_still(const camera_fb_t *fb, const int64_t capture_time, uint8_t quality) {
+    if (quality == 0) {
+        quality = encoders[0].quality;
+    }
+    if (still_encoder.handle == NULL && open_encoder(&still_encoder, false, sched_core(SCHED_ROLE_ENCODING)) != ESP_OK) {
+        return NULL;
+    }
+    if (quality != still_encoder.quality) {
+        if (jpeg_enc_set_quality(still_encoder.handle, quality) != JPEG_ERR_OK) {
+            ESP_LOGE(TAG_MIMI, "Failed to set still quality %d", quality);
+            return NULL;
+        }
+        still_encoder.quality = quality;
+    }
+
+    jpeg_frame_t *jpeg_frame = frame_pool_acquire();
+    if (jpeg_frame == NULL) {
+        ESP_LOGW(TAG_MIMI, "All JPEG frames are in use, no still");
+        return NULL;
+    }
+    int in_len = 0;
+    int64_t copy_us;
+    const uint8_t *in_buf = get_encoder_input(&still_encoder, fb, &in_len, &copy_us);
+    int jpeg_len = 0;
+    if (in_buf == NULL ||
+        jpeg_enc_process(still_encoder.handle, in_buf, in_len, jpeg_frame->fb.buf,
+                         (int)jpeg_frame->buf_size, &jpeg_len) != JPEG_ERR_OK || jpeg_len <= 0) {
+        ESP_LOGE(TAG_MIMI, "Still encoding failed");
+        jpeg_frame_release(jpeg_frame);
+        return NULL;
+    }
+    jpeg_frame->fb.width = encoded_width();
+    jpeg_frame->fb.height = encoded_height();
+    jpeg_frame->fb.len = jpeg_len;
+    jpeg_frame->capture_time = capture_time;
+    frame_pool_mark_published(jpeg_frame);
+    ESP_LOGI(TAG_MIMI, "Still at quality %d: %d bytes in %" PRIu32 " us", quality, jpeg_len,
+             (uint32_t)(esp_timer_get_time() - capture_time));
+    return jpeg_frame;
+}
+
+/**
+ * Encodes the framebuffer for a pending camera_capture_still() request, before it goes to the stream encoder.
+ */
+static void serve_still_request(const camera_fb_t *fb, const int64_t capture_time) {
+    still_request_t request;
+    if (xQueueReceive(still_requests, &request, 0) != pdTRUE) {
+        return;
+    }
+    const still_result_t result = {.id = request.id, .frame = encode_still(fb, capture_time, request.quality)};
+    if (xQueueSend(still_results, &result, 0) != pdTRUE && result.frame != NULL) {
+        jpeg_frame_release(result.frame);
+    }
+}
+
+static void benchmark_encode(const camera_fb_t *fb, const jpeg_pixel_format_t src_type,
+                             const jpeg_subsampling_t subsampling, const uint8_t quality, jpeg_frame_t *jpeg_frame,
+                             camera_encode_sample_t *sample) {
+    camera_encoder_t encoder = {0};
+    if (open_jpeg_encoder(&encoder, src_type, subsampling, quality, false, sched_core(SCHED_ROLE_ENCODING)) != ESP_OK) {
         return;
     }
+    int in_len = 0;
+    int64_t copy_us;
+    const uint8_t *in_buf = get_encoder_input(&encoder, fb, &in_len, &copy_us);
+    int jpeg_len = 0;
+    const int64_t encode_start_time = esp_timer_get_time();
+    if (in_buf != NULL && jpeg_enc_process(encoder.handle, in_buf, in_len, jpeg_frame->fb.buf,
+                                           (int)jpeg_frame->buf_size, &jpeg_len) == JPEG_ERR_OK) {
+        sample->convert_us = src_type == JPEG_PIXEL_FORMAT_YCbY2YCrY2 ? (uint32_t)copy_us : 0;
+        sample->encode_us = (uint32_t)(esp_timer_get_time() - encode_start_time);
+        sample->bytes = jpeg_len;
+    }
+    close_encoder(&encoder);
+}
+
+/**
+ * Encodes the framebuffer for a pending camera_benchmark_yuv420() request, on encoders of its own.
+ */
+static void serve_benchmark_request(const camera_fb_t *fb) {
+    if (!benchmark_requested) {
+        return;
+    }
+    benchmark_requested = false;
+    camera_yuv420_benchmark_t result = {
+        .width = encoded_width(),
+        .height = encoded_height(),
+        .quality = encoders[0].quality,
+    };
+    jpeg_frame_t *jpeg_frame = frame_pool_acquire();
+    if (jpeg_frame != NULL) {
+        benchmark_encode(fb, JPEG_PIXEL_FORMAT_YCbYCr, JPEG_SUBSAMPLE_422, result.quality, jpeg_frame,
+                         &result.yuv422);
+        benchmark_encode(fb, JPEG_PIXEL_FORMAT_YCbYCr, JPEG_SUBSAMPLE_420, result.quality, jpeg_frame,
+                         &result.yuv420);
+        if (yuv420_convertible(result.width, result.height)) {
+            benchmark_encode(fb, JPEG_PIXEL_FORMAT_YCbY2YCrY2, JPEG_SUBSAMPLE_420, result.quality, jpeg_frame,
+                             &result.converted);
+        }
+        jpeg_frame_release(jpeg_frame);
+    }
+    xQueueSend(benchmark_results, &result, 0);
+}
+
+esp_err_t camera_benchmark_yuv420(camera_yuv420_benchmark_t *result, const uint32_t timeout_ms) {
+    xQueueReset(benchmark_results); // Of an earlier request that timed out
+    benchmark_requested = true;
+    wake_camera_task();
+    return xQueueReceive(benchmark_results, result, pdMS_TO_TICKS(timeout_ms)) == pdTRUE ? ESP_OK : ESP_ERR_TIMEOUT;
+}
+
+jpeg_frame_t *camera_capture_still(const uint8_t quality, const uint32_t timeout_ms) {
+    xSemaphoreTake(still_mutex, portMAX_DELAY);
+    still_result_t result;
+    while (xQueueReceive(still_results, &result, 0) == pdTRUE) { // Of an earlier request that timed out
+        if (result.frame != NULL) {
+            jpeg_frame_release(result.frame);
+        }
+    }
+
+    jpeg_frame_t *frame = NULL;
+    const still_request_t request = {.id = ++next_still_id, .quality = quality};
+    if (xQueueSend(still_requests, &request, 0) == pdTRUE) {
+        wake_camera_task();
+        if (xQueueReceive(still_results, &result, pdMS_TO_TICKS(timeout_ms)) == pdTRUE) {
+            if (result.id == request.id) {
+                frame = result.frame;
+            } else if (result.frame != NULL) {
+                jpeg_frame_release(result.frame);
+            }
+        }
+    }
+    xSemaphoreGive(still_mutex);
+    return frame;
+}
+
+#if CAMERA_DUAL_ENCODER
+/**
+ * Dual-encoder mode: publishes the frame once all earlier frames are published. Blocks the calling encoder until
+ * then, so each encoder has at most one frame waiting here. `result` is NULL if the frame was dropped.
+ */
+static void reorder_and_publish(const int encoder_index, const uint32_t seq, const encode_result_t *result) {
+    xSemaphoreTake(reorder_mutex, portMAX_DELAY);
+    const int slot = (int)(seq % CAMERA_ENCODER_COUNT);
+    reorder_results[slot] = result != NULL ? *result : (encode_result_t){0};
+    reorder_ready[slot] = true;
+    reorder_waiters[slot] = NULL;
+
+    while (reorder_ready[next_publish_seq % CAMERA_ENCODER_COUNT]) {
+        const int next_slot = (int)(next_publish_seq % CAMERA_ENCODER_COUNT);
+        reorder_ready[next_slot] = false;
+        if (reorder_results[next_slot].jpeg_frame != NULL) {
+            publish_frame(&reorder_results[next_slot]);
+        }
+        if (reorder_waiters[next_slot] != NULL) {
+            xTaskNotifyGive(reorder_waiters[next_slot]);
+        }
+        next_publish_seq++;
+    }
+
+    const bool published = !reorder_ready[slot];
+    if (!published) {
+        reorder_waiters[slot] = xTaskGetCurrentTaskHandle();
+    }
+    xSemaphoreGive(reorder_mutex);
+
+    if (!published) {
+        ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+    }
+    ESP_LOGV(TAG_MIMI, "Encoder %d published frame %" PRIu32, encoder_index, seq);
+}
+
+static void encoder_task(void *arg) {
+    const int index = (int)(intptr_t)arg;
+    camera_encoder_t *encoder = &encoders[index];
 
     // ReSharper disable once CppDFAEndlessLoop
     while (true) {
-        camera_fb_t *fb = esp_camera_fb_get();
-        if (!fb) {
-            ESP_LOGE(TAG_MIMI, "Camera capture failed");
-            vTaskDelay(pdMS_TO_TICKS(15));
+        capture_job_t job;
+        xQueueReceive(encoder->jobs, &job, portMAX_DELAY);
+        if (job.fb == NULL) { // Flush for a reconfiguration: all earlier jobs of this encoder are published
+            xSemaphoreGive(encoders_flushed);
             continue;
         }
+        encode_result_t result;
+        const bool encoded = encode_frame(encoder, job.fb, job.capture_time, false, &result);
+        reorder_and_publish(index, job.seq, encoded ? &result : NULL);
+    }
+}
 
-        jpeg_frame_t *jpeg_frame = &jpeg_pool[jpeg_pool_index];
-        jpeg_pool_index = (jpeg_pool_index + 1) % JPEG_FRAME_POOL_SIZE;
+static esp_err_t start_dual_encoders(void) {
+    reorder_mutex = xSemaphoreCreateMutex();
+    encoders_flushed = xSemaphoreCreateCounting(CAMERA_ENCODER_COUNT, 0);
+    if (open_encoders() != ESP_OK) {
+        return ESP_FAIL;
+    }
+    for (int i = 0; i < CAMERA_ENCODER_COUNT; i++) {
+        encoders[i].jobs = xQueueCreate(1, sizeof(capture_job_t));
+        char name[16];
+        snprintf(name, sizeof(name), "encoder_%d", i);
+        TaskHandle_t task = NULL;
+        if (xTaskCreatePinnedToCore(encoder_task, name, ENCODER_TASK_STACK_SIZE, (void *)(intptr_t)i,
+                                    sched_priority(SCHED_ROLE_ENCODING), &task, i) != pdPASS) {
+            ESP_LOGE(TAG_MIMI, "Failed to create %s task", name);
+            return ESP_FAIL;
+        }
+        sched_register_task(task, SCHED_ROLE_ENCODING);
+    }
+    ESP_LOGI(TAG_MIMI, "Dual-encoder mode: %d encoders, one per core", CAMERA_ENCODER_COUNT);
+    return ESP_OK;
+}
 
-        memcpy(jpeg_frame->in_buf, fb->buf, fb->len);
-        int jpeg_len = 0;
-        const jpeg_error_t jret = jpeg_enc_process(
-            jpeg_enc,
-            jpeg_frame->in_buf, (int)fb->len,
-            jpeg_frame->fb.buf, MAX_JPEG_SIZE,
-            &jpeg_len
-        );
+/**
+ * Waits until the encoders have published every frame dispatched to them, they are idle afterwards.
+ */
+static void flush_dual_encoders(void) {
+    const capture_job_t flush = {.fb = NULL};
+    for (int i = 0; i < CAMERA_ENCODER_COUNT; i++) {
+        xQueueSend(encoders[i].jobs, &flush, portMAX_DELAY);
+    }
+    for (int i = 0; i < CAMERA_ENCODER_COUNT; i++) {
+        xSemaphoreTake(encoders_flushed, portMAX_DELAY);
+    }
+}
+#endif
 
-        esp_camera_fb_return(fb);
+static esp_err_t switch_video_mode(const camera_video_mode_t *mode, const bool restart, const bool reopen) {
+    const bool moved = memcmp(&mode->roi, &video_mode.roi, sizeof(camera_roi_t)) != 0;
+    video_mode = *mode;
+    if (restart) {
+        select_frame_size();
+        if (sensor_running) { // Otherwise it starts in the new mode on the next wakeup
+            esp_camera_deinit();
+            const esp_err_t err = start_sensor();
+            if (err != ESP_OK) {
+                return err;
+            }
+        }
+    } else if (moved && sensor_windowed && sensor_running) {
+        // The region moved within the same frame size: only the window registers change
+        const camera_resolution_t *resolution = find_resolution(mode->width, mode->height);
+        const esp_err_t err = gc2145_set_window(resolution->frame_size, resolution->width, resolution->height,
+                                                &mode->roi, true);
+        if (err != ESP_OK) {
+            return err;
+        }
+        skip_frames = 1; // Read out while the window changed
+    }
+    if (reopen) {
+        for (int i = 0; i < CAMERA_ENCODER_COUNT; i++) {
+            close_encoder(&encoders[i]);
+        }
+        close_encoder(&still_encoder); // Reopened on the next still request
+        return open_encoders();
+    }
+    return ESP_OK;
+}
+
+/**
+ * Runs in the camera task between frames: no framebuffer is held and no frame is being encoded. Frames already
+ * published keep their size, subscribers simply get frames of the new mode after them.
+ */
+static esp_err_t apply_video_mode(const camera_video_mode_t *mode) {
+    if (find_resolution(mode->width, mode->height) == NULL) {
+        return ESP_ERR_NOT_SUPPORTED;
+    }
+    const int64_t start_time = esp_timer_get_time();
+#if CAMERA_DUAL_ENCODER
+    flush_dual_encoders();
+#endif
+    const camera_video_mode_t previous = video_mode;
+    const bool crop = memcmp(&mode->roi, &previous.roi, sizeof(camera_roi_t)) != 0;
+    const bool pan = sensor_windowed && sensor_can_crop(mode) && mode->roi.width == previous.roi.width &&
+                     mode->roi.height == previous.roi.height;
+    // A region the sensor crops (or cropped) changes its frame size, unless the region just moves
+    const bool restart = mode->width != previous.width || mode->height != previous.height ||
+                         (crop && (sensor_windowed || sensor_can_crop(mode)) && !pan);
+    const bool reopen = restart || crop || mode->subsampling != previous.subsampling ||
+                        mode->convert_420 != previous.convert_420;
 
-        if (jret != JPEG_ERR_OK || jpeg_len <= 0) {
-            ESP_LOGE(TAG_MIMI, "JPEG encoding failed (%d)", jret);
-            vTaskDelay(pdMS_TO_TICKS(15));
+    esp_err_t err = switch_video_mode(mode, restart, reopen);
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG_MIMI, "Video mode switch failed (0x%x), going back to the previous mode", err);
+        if (switch_video_mode(&previous, restart, reopen) != ESP_OK) {
+            ESP_LOGE(TAG_MIMI, "Failed to restore the previous video mode");
+        }
+        return err;
+    }
+    if (restart) {
+        frame_pool_resize(frame_buffer_size());
+    }
+    if (restart || crop) {
+        rate_control_reset();
+    }
+
+    char description[48];
+    camera_format_video_mode(&video_mode, description, sizeof(description));
+    ESP_LOGI(TAG_MIMI, "Video mode %s applied in %" PRIu32 " ms", description,
+             (uint32_t)((esp_timer_get_time() - start_time) / 1000));
+    return ESP_OK;
+}
+
+static void serve_reconfigure_request(void) {
+    camera_video_mode_t mode;
+    if (xQueueReceive(reconfigure_requests, &mode, 0) != pdTRUE) {
+        return;
+    }
+    const esp_err_t err = apply_video_mode(&mode);
+    xQueueSend(reconfigure_results, &err, 0);
+}
+
+static bool roi_fits(const camera_video_mode_t *mode) {
+    const camera_roi_t *roi = &mode->roi;
+    return roi->width == 0 ||
+           (roi->height > 0 && roi->width % CAMERA_ROI_ALIGNMENT == 0 && roi->height % CAMERA_ROI_ALIGNMENT == 0 &&
+            roi->x % CAMERA_ROI_X_ALIGNMENT == 0 && roi->x + roi->width <= mode->width &&
+            roi->y + roi->height <= mode->height);
+}
+
+esp_err_t camera_reconfigure(const camera_video_mode_t *mode) {
+    if (find_resolution(mode->width, mode->height) == NULL || mode->quality > 100 || mode->max_fps > CAMERA_MAX_FPS) {
+        return ESP_ERR_NOT_SUPPORTED;
+    }
+    camera_video_mode_t new_mode = *mode;
+    if (!roi_fits(&new_mode)) {
+        if (memcmp(&new_mode.roi, &video_mode.roi, sizeof(camera_roi_t)) != 0) {
+            return ESP_ERR_NOT_SUPPORTED;
+        }
+        ESP_LOGW(TAG_MIMI, "Region of interest doesn't fit %dx%d, encoding whole frames", mode->width, mode->height);
+        new_mode.roi = (camera_roi_t){0};
+    }
+    xSemaphoreTake(reconfigure_mutex, portMAX_DELAY);
+    esp_err_t err;
+    while (xQueueReceive(reconfigure_results, &err, 0) == pdTRUE) {
+        // Of an earlier request that timed out
+    }
+    if (xQueueSend(reconfigure_requests, &new_mode, 0) != pdTRUE) {
+        err = ESP_ERR_TIMEOUT;
+    } else {
+        wake_camera_task();
+        if (xQueueReceive(reconfigure_results, &err, pdMS_TO_TICKS(CAMERA_RECONFIGURE_TIMEOUT_MS)) != pdTRUE) {
+            err = ESP_ERR_TIMEOUT;
+        }
+    }
+    xSemaphoreGive(reconfigure_mutex);
+    return err;
+}
+
+void camera_get_video_mode(camera_video_mode_t *mode) {
+    *mode = video_mode;
+}
+
+int camera_format_video_mode(const camera_video_mode_t *mode, char *buf, const size_t len) {
+    const char *subsampling = mode->subsampling == JPEG_SUBSAMPLE_GRAY  ? "gray"
+                            : mode->subsampling == JPEG_SUBSAMPLE_420 ? "420"
+                            : mode->subsampling == JPEG_SUBSAMPLE_444 ? "444"
+                                                                      : "422";
+    if (mode->quality == 0) {
+        return snprintf(buf, len, "%d %d qauto %s fps%d", mode->width, mode->height, subsampling, mode->max_fps);
+    }
+    return snprintf(buf, len, "%d %d q%d %s fps%d", mode->width, mode->height, mode->quality, subsampling,
+                    mode->max_fps);
+}
+
+#if CAMERA_DEMAND_DRIVEN
+static void stop_sensor(void) {
+#if CAMERA_DUAL_ENCODER
+    flush_dual_encoders(); // The encoders hold framebuffers until they are done
+#endif
+    esp_camera_deinit();
+    gpio_set_direction(CAM_PIN_PWDN, GPIO_MODE_OUTPUT);
+    gpio_set_level(CAM_PIN_PWDN, 1); // esp_camera_init() powers the sensor up again
+    sensor_running = false;
+    idle_since = esp_timer_get_time();
+    portENTER_CRITICAL(&power_stats_mux);
+    power_stats.active = false;
+    portEXIT_CRITICAL(&power_stats_mux);
+    ESP_LOGI(TAG_MIMI, "No subscribers for %d ms, camera powered down", CAMERA_IDLE_TIMEOUT_MS);
+}
+
+static esp_err_t wake_sensor(void) {
+    const int64_t start_time = esp_timer_get_time();
+    const esp_err_t err = start_sensor();
+    if (err != ESP_OK) {
+        return err;
+    }
+    const int64_t started_time = esp_timer_get_time();
+    sensor_running = true;
+    wake_time = start_time;
+    skip_frames = CAMERA_WAKE_SKIP_FRAMES;
+    sensor_fps_frames = 0;
+    sensor_fps_start_time = start_time;
+    portENTER_CRITICAL(&power_stats_mux);
+    power_stats.active = true;
+    power_stats.wakeups++;
+    power_stats.idle_ms += (start_time - idle_since) / 1000;
+    portEXIT_CRITICAL(&power_stats_mux);
+    ESP_LOGI(TAG_MIMI, "Camera woke up after %" PRIu32 " s idle, sensor started in %" PRIu32 " ms",
+             (uint32_t)((start_time - idle_since) / 1000000), (uint32_t)((started_time - start_time) / 1000));
+    return ESP_OK;
+}
+
+/**
+ * Returns true when frames are wanted: by a subscriber, a still request, or within CAMERA_IDLE_TIMEOUT_MS of the
+ * last subscriber leaving (viewers tend to reconnect right away). After that the sensor is powered down and the
+ * task sleeps until a subscriber or a request arrives; false is returned then.
+ */
+static bool wait_for_demand(void) {
+    const int64_t now = esp_timer_get_time();
+    if (frame_bus_subscriber_count() > 0 || uxQueueMessagesWaiting(still_requests) > 0 || benchmark_requested) {
+        last_demand_time = now;
+        if (!sensor_running && wake_sensor() != ESP_OK) {
+            vTaskDelay(pdMS_TO_TICKS(1000));
+            return false;
+        }
+        return true;
+    }
+    if (sensor_running && now - last_demand_time < CAMERA_IDLE_TIMEOUT_MS * 1000LL) {
+        return true;
+    }
+    if (sensor_running) {
+        stop_sensor();
+    }
+    ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+    return false;
+}
+#endif
+
+static void count_sensor_frame(const int64_t capture_time) {
+    sensor_fps_frames++;
+    if (capture_time - sensor_fps_start_time >= 1000000) {
+        sensor_fps = (uint32_t)(sensor_fps_frames * 1000000LL / (capture_time - sensor_fps_start_time));
+        sensor_fps_frames = 0;
+        sensor_fps_start_time = capture_time;
+    }
+}
+
+uint32_t camera_get_sensor_fps(void) {
+    return sensor_running ? sensor_fps : 0;
+}
+
+void camera_get_power_stats(camera_power_stats_t *stats) {
+    portENTER_CRITICAL(&power_stats_mux);
+    *stats = power_stats;
+    if (!power_stats.active) {
+        stats->idle_ms += (esp_timer_get_time() - idle_since) / 1000;
+    }
+    portEXIT_CRITICAL(&power_stats_mux);
+}
+
+void camera_task(void *)
+{
+    if (frame_pool_init(frame_buffer_size()) != ESP_OK) {
+        vTaskDelete(NULL);
+        return;
+    }
+
+#if CAMERA_DUAL_ENCODER
+    if (start_dual_encoders() != ESP_OK) {
+        vTaskDelete(NULL);
+        return;
+    }
+    uint32_t seq = 0;
+#else
+    if (open_encoders() != ESP_OK) {
+        vTaskDelete(NULL);
+        return;
+    }
+#endif
+    boot_mark("frame pool and encoder ready");
+    int64_t last_frame_time = 0;
+    last_demand_time = esp_timer_get_time();
+    camera_task_handle = xTaskGetCurrentTaskHandle();
+    frame_bus_set_demand_task(camera_task_handle);
+
+    // ReSharper disable once CppDFAEndlessLoop
+    while (true) {
+        serve_reconfigure_request();
+#if CAMERA_DEMAND_DRIVEN
+        if (!wait_for_demand()) {
             continue;
         }
+#endif
 
-        jpeg_frame->fb.width = fb->width;
-        jpeg_frame->fb.height = fb->height;
-        jpeg_frame->fb.len = jpeg_len;
+        const int64_t capture_start_time = esp_timer_get_time();
+        camera_fb_t *fb = esp_camera_fb_get();
+        if (!fb) {
+            ESP_LOGE(TAG_MIMI, "Camera capture failed");
+            metrics_count(METRIC_COUNTER_CAPTURE_FAILED);
+            // Returns at once without a driver (a mode switch failed to restart the sensor): don't starve core 0
+            ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(CAPTURE_RETRY_MS));
+            continue;
+        }
+        const int64_t capture_time = esp_timer_get_time();
+        metrics_record(METRIC_STAGE_CAPTURE_WAIT, capture_time - capture_start_time);
+        count_sensor_frame(capture_time);
+        if (skip_frames > 0) {
+            skip_frames--;
+            esp_camera_fb_return(fb);
+            continue;
+        }
+        serve_still_request(fb, capture_time);
+        serve_benchmark_request(fb);
+        if (CAMERA_DEMAND_DRIVEN && frame_bus_subscriber_count() == 0) {
+            esp_camera_fb_return(fb); // Kept capturing for a while in case a viewer comes back, but not encoding
+            continue;
+        }
+
+        if (video_mode.max_fps != 0 &&
+            capture_time - last_frame_time < 1000000 / video_mode.max_fps - FPS_LIMIT_TOLERANCE_US) {
+            esp_camera_fb_return(fb);
+            continue;
+        }
+        if (!motion_frame_changed(fb, capture_time)) {
+            esp_camera_fb_return(fb); // Static scene, the previous frame still shows it
+            metrics_count(METRIC_COUNTER_SKIPPED_STATIC);
+            continue;
+        }
+        last_frame_time = capture_time;
 
-        if (xQueueSend(frame_queue, &jpeg_frame, 0) != pdTRUE) {
-            ESP_LOGD(TAG_MIMI, "Frame queue full, dropping frame. Frame size: %d bytes.", jpeg_len);
+#if CAMERA_DUAL_ENCODER
+        // Frames alternate between the encoders; waits here while the next encoder is still busy.
+        // Low-latency (stripe) encoding is not used: frames encoded in parallel can't be streamed in order.
+        const capture_job_t job = {.fb = fb, .capture_time = capture_time, .seq = seq};
+        xQueueSend(encoders[seq % CAMERA_ENCODER_COUNT].jobs, &job, portMAX_DELAY);
+        seq++;
+#else
+        encode_result_t result;
+        if (encode_frame(&encoders[0], fb, capture_time, low_latency_mode, &result)) {
+            publish_frame(&result);
         }
+#endif
     }
 }
@@ -2,15 +2,115 @@
 #define MIMI_CAMERA_H
 
 #include "esp_camera.h"
+#include "esp_jpeg_common.h"
+#include "mimi_frame_pool.h"
 
-#define JPEG_FRAME_POOL_SIZE 3
+// 1: camera framebuffers are passed to the JPEG encoder directly (no per-frame memcpy), 0: always copy.
+#define CAMERA_ZERO_COPY 1
+
+// Initial state of the low-latency mode: frames are encoded in MCU stripes and streamed while being encoded.
+#define CAMERA_LOW_LATENCY_MODE 0
+
+// 1: two encoder instances, one pinned to each core, encode alternating frames (published in capture order).
+// Raises throughput when encoding is the bottleneck (e.g. HVGA). The low-latency mode is not used then.
+#define CAMERA_DUAL_ENCODER 0
+
+// 1: the sensor is powered down while nobody subscribes to frames, the first subscriber or still request wakes it
+#define CAMERA_DEMAND_DRIVEN 1
+#define CAMERA_IDLE_TIMEOUT_MS 5000     // Without subscribers for this long the sensor is stopped
+#define CAMERA_WAKE_SKIP_FRAMES 2       // Dropped after power-up while the auto exposure settles
+
+#define CAMERA_ROI_ALIGNMENT 16         // Region of interest width and height, in pixels: whole MCUs in every subsampling
+#define CAMERA_ROI_X_ALIGNMENT 8        // Region of interest x, in pixels: every row of it starts 16-byte aligned
+
+// 1: a region of interest of a size the sensor can output (96x96, 128x128, 176x144, 240x176, 240x240, 320x240 or
+// 320x320) is cropped by the GC2145 itself: only its pixels are read out and transferred. 0: always cropped in software.
+// Off until the window register sequence in mimi_gc2145.c has been verified on hardware.
+#define CAMERA_SENSOR_WINDOWING 0
+
+#define CAMERA_MAX_FPS 60               // Highest frame rate limit a video mode may ask for
+#define CAMERA_STILL_TIMEOUT_MS 2000    // Includes waking the sensor up
+#define CAMERA_RECONFIGURE_TIMEOUT_MS 5000
+
+typedef struct {
+    uint16_t x;
+    uint16_t y;
+    uint16_t width;                  // 0: no region of interest, the whole frame is encoded
+    uint16_t height;
+} camera_roi_t;
+
+typedef struct {
+    uint16_t width;                  // One of the sensor modes in mimi_camera.c (160x120 ... 480x320)
+    uint16_t height;
+    uint8_t quality;                 // 1-100, 0: set by the rate control
+    jpeg_subsampling_t subsampling;
+    uint8_t max_fps;                 // 0: as fast as the sensor delivers
+    camera_roi_t roi;                // Cut out of the sensor frame before encoding, frames have its size then
+    bool convert_420;                // 4:2:0 only: frames are converted to YCbY2YCrY2 (mimi_yuv.h) for the encoder
+} camera_video_mode_t;
+
+/**
+ * Starts the sensor in `mode` (NULL: the built-in 320x320 default; an unsupported mode falls back to it).
+ */
+esp_err_t init_camera(const camera_video_mode_t *mode);
+void camera_set_low_latency_mode(bool enabled);
+bool camera_get_low_latency_mode(void);
+
+typedef struct {
+    bool active;                       // Sensor powered and capturing
+    uint32_t wakeups;
+    uint32_t time_to_first_frame_ms;   // Of the latest wakeup: demand to the first frame published
+    uint64_t idle_ms;                  // Total time the sensor was stopped
+} camera_power_stats_t;
+
+/**
+ * Encodes the next camera frame at `quality` (1-100, 0: the stream's current quality) on an encoder of its own,
+ * the stream's encoder and rate control are not affected. Wakes the sensor if it is idle.
+ * Returns the frame with a reference the caller must release, NULL on failure.
+ */
+jpeg_frame_t *camera_capture_still(uint8_t quality, uint32_t timeout_ms);
+/**
+ * Switches the pipeline to a new mode without a reboot: the camera task finishes the frame in progress, restarts
+ * the sensor and reopens the encoders as needed, and goes on streaming to the same subscribers. Goes back to the
+ * previous mode if the new one fails to start. A region of interest that doesn't fit a new resolution is dropped.
+ * ESP_ERR_NOT_SUPPORTED for an unknown resolution, quality above 100 or max_fps above CAMERA_MAX_FPS.
+ */
+esp_err_t camera_reconfigure(const camera_video_mode_t *mode);
+void camera_get_video_mode(camera_video_mode_t *mode);
+
+/**
+ * "<width> <height> q<quality>|qauto 422|420|444|gray fps<max_fps>", as the video-mode command takes it.
+ */
+int camera_format_video_mode(const camera_video_mode_t *mode, char *buf, size_t len);
+
+void camera_get_power_stats(camera_power_stats_t *stats);
+
+typedef struct {
+    uint32_t convert_us;             // Conversion to YCbY2YCrY2, 0 if the encoder takes the frame as it is
+    uint32_t encode_us;
+    uint32_t bytes;                  // 0: failed
+} camera_encode_sample_t;
 
 typedef struct {
-    uint8_t *in_buf;      // Aligned input buffer (for encoder)
-    camera_fb_t fb;       // Output JPEG frame struct (for streaming)
-} jpeg_frame_t;
+    uint16_t width;
+    uint16_t height;
+    uint8_t quality;
+    camera_encode_sample_t yuv422;   // YCbYCr, 4:2:2
+    camera_encode_sample_t yuv420;   // YCbYCr, 4:2:0 subsampled by the encoder
+    camera_encode_sample_t converted; // YCbY2YCrY2 from yuv422_to_yuv420(), 4:2:0
+} camera_yuv420_benchmark_t;
+
+/**
+ * Encodes the next camera frame (of the current video mode and region of interest, at the stream's quality) in
+ * all three ways on encoders of its own, the stream is not affected.
+ */
+esp_err_t camera_benchmark_yuv420(camera_yuv420_benchmark_t *result, uint32_t timeout_ms);
+
+/**
+ * Frames per second the sensor delivered over the last second, before any frame is skipped. 0 while idle.
+ */
+uint32_t camera_get_sensor_fps(void);
 
-esp_err_t init_camera(void);
 void camera_task(void *);
 
 #endif //MIMI_CAMERA_H
@@ -1,8 +1,17 @@
 #include "mimi_command_processor.h"
 
+#include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 
+#include "mimi_camera.h"
 #include "mimi_common.h"
+#include "mimi_config.h"
+#include "mimi_frame_pool.h"
+#include "mimi_language.h"
+#include "mimi_motion.h"
+#include "mimi_sched.h"
+#include "esp_timer.h"
 #include "driver/uart.h"
 
 typedef struct {
@@ -21,8 +30,380 @@ int pingCameraCommand(char* commandLine, unsigned int startPosition) {
     return 0;
 }
 
+int poolStatsCommand(char* commandLine, unsigned int startPosition) {
+    frame_pool_stats_t stats;
+    frame_pool_get_stats(&stats);
+    char message[96];
+    snprintf(message, sizeof(message), "pool-stats %lu %lu %lu %lu %d\r\n",
+             stats.acquired, stats.exhausted, stats.in_use, stats.max_in_use, JPEG_FRAME_POOL_SIZE);
+    uartOutputMessage(message);
+    return 0;
+}
+
+int lowLatencyCommand(char* commandLine, unsigned int startPosition) {
+    char argument[MAX_ARGUMENT_LENGTH];
+    bool isString;
+    extractLexeme(startPosition, strlen(commandLine), commandLine, argument, &isString);
+    if (strcmp(argument, "on") == 0) {
+        camera_set_low_latency_mode(true);
+    } else if (strcmp(argument, "off") == 0) {
+        camera_set_low_latency_mode(false);
+    } else if (argument[0] != '\0') {
+        uartOutputMessage("error low-latency on|off\r\n");
+        return 1;
+    }
+    uartOutputMessage(camera_get_low_latency_mode() ? "low-latency on\r\n" : "low-latency off\r\n");
+    return 0;
+}
+
+static void outputVideoMode(void) {
+    camera_video_mode_t mode;
+    camera_get_video_mode(&mode);
+    char description[48];
+    camera_format_video_mode(&mode, description, sizeof(description));
+    char message[64];
+    snprintf(message, sizeof(message), "video-mode %s\r\n", description);
+    uartOutputMessage(message);
+}
+
+/**
+ * video-mode <width> <height> [q<quality>|qauto] [422|420|444|gray] [fps<max_fps>], options left out keep their
+ * current value. No arguments: query.
+ */
+int videoModeCommand(char* commandLine, unsigned int startPosition) {
+    const unsigned int length = strlen(commandLine);
+    char argument[MAX_ARGUMENT_LENGTH];
+    bool isString;
+    unsigned int position = extractLexeme(startPosition, length, commandLine, argument, &isString);
+    if (argument[0] == '\0') {
+        outputVideoMode();
+        return 0;
+    }
+
+    camera_video_mode_t mode;
+    camera_get_video_mode(&mode);
+    bool valid = true;
+    mode.width = atoi(argument);
+    position = extractLexeme(position, length, commandLine, argument, &isString);
+    mode.height = atoi(argument);
+    position = extractLexeme(position, length, commandLine, argument, &isString);
+    while (argument[0] != '\0' && valid) {
+        if (strcmp(argument, "qauto") == 0) {
+            mode.quality = 0;
+        } else if (argument[0] == 'q' && atoi(argument + 1) > 0 && atoi(argument + 1) <= 100) {
+            mode.quality = atoi(argument + 1);
+        } else if (strncmp(argument, "fps", 3) == 0 && atoi(argument + 3) >= 0 &&
+                   atoi(argument + 3) <= CAMERA_MAX_FPS) {
+            mode.max_fps = atoi(argument + 3);
+        } else if (strcmp(argument, "422") == 0) {
+            mode.subsampling = JPEG_SUBSAMPLE_422;
+        } else if (strcmp(argument, "420") == 0) {
+            mode.subsampling = JPEG_SUBSAMPLE_420;
+        } else if (strcmp(argument, "444") == 0) {
+            mode.subsampling = JPEG_SUBSAMPLE_444;
+        } else if (strcmp(argument, "gray") == 0) {
+            mode.subsampling = JPEG_SUBSAMPLE_GRAY;
+        } else {
+            valid = false;
+        }
+        position = extractLexeme(position, length, commandLine, argument, &isString);
+    }
+
+    if (!valid || camera_reconfigure(&mode) != ESP_OK) {
+        uartOutputMessage("error video-mode <width> <height> [q<quality>|qauto] [422|420|444|gray] [fps<n>]\r\n");
+        return 1;
+    }
+    outputVideoMode();
+    return 0;
+}
+
+static void outputRoi(void) {
+    camera_video_mode_t mode;
+    camera_get_video_mode(&mode);
+    char message[48];
+    if (mode.roi.width == 0) {
+        snprintf(message, sizeof(message), "roi off\r\n");
+    } else {
+        snprintf(message, sizeof(message), "roi %d %d %d %d\r\n", mode.roi.x, mode.roi.y, mode.roi.width,
+                 mode.roi.height);
+    }
+    uartOutputMessage(message);
+}
+
+/**
+ * roi <x> <y> <width> <height> | off: encodes only that region of the sensor frame. No arguments: query.
+ */
+int roiCommand(char* commandLine, unsigned int startPosition) {
+    const unsigned int length = strlen(commandLine);
+    char argument[MAX_ARGUMENT_LENGTH];
+    bool isString;
+    unsigned int position = extractLexeme(startPosition, length, commandLine, argument, &isString);
+    if (argument[0] == '\0') {
+        outputRoi();
+        return 0;
+    }
+
+    camera_video_mode_t mode;
+    camera_get_video_mode(&mode);
+    if (strcmp(argument, "off") == 0) {
+        mode.roi = (camera_roi_t){0};
+    } else {
+        int values[4];
+        values[0] = atoi(argument);
+        for (int i = 1; i < 4; i++) {
+            position = extractLexeme(position, length, commandLine, argument, &isString);
+            values[i] = atoi(argument);
+        }
+        mode.roi = (camera_roi_t){.x = values[0], .y = values[1], .width = values[2], .height = values[3]};
+    }
+    if (camera_reconfigure(&mode) != ESP_OK) {
+        uartOutputMessage("error roi <x> <y> <width> <height>|off (sizes multiple of 16, x of 8)\r\n");
+        return 1;
+    }
+    outputRoi();
+    return 0;
+}
+
+/**
+ * yuv420 on|off: converts frames to YCbY2YCrY2 for the encoder when the video mode is 4:2:0. No arguments: query.
+ */
+int yuv420Command(char* commandLine, unsigned int startPosition) {
+    char argument[MAX_ARGUMENT_LENGTH];
+    bool isString;
+    extractLexeme(startPosition, strlen(commandLine), commandLine, argument, &isString);
+    camera_video_mode_t mode;
+    camera_get_video_mode(&mode);
+    if (strcmp(argument, "on") == 0 || strcmp(argument, "off") == 0) {
+        mode.convert_420 = strcmp(argument, "on") == 0;
+        if (camera_reconfigure(&mode) != ESP_OK) {
+            uartOutputMessage("error yuv420 reconfiguration failed\r\n");
+            return 1;
+        }
+    } else if (argument[0] != '\0') {
+        uartOutputMessage("error yuv420 on|off\r\n");
+        return 1;
+    }
+    uartOutputMessage(mode.convert_420 ? "yuv420 on\r\n" : "yuv420 off\r\n");
+    return 0;
+}
+
+/**
+ * yuv420-bench: encodes the next frame as 4:2:2, as 4:2:0 subsampled by the encoder and as 4:2:0 converted here.
+ * Replies "<width> <height> q<quality>" followed by "<convert us> <encode us> <bytes>" for each.
+ */
+int yuv420BenchCommand(char* commandLine, unsigned int startPosition) {
+    camera_yuv420_benchmark_t result;
+    if (camera_benchmark_yuv420(&result, CAMERA_STILL_TIMEOUT_MS) != ESP_OK) {
+        uartOutputMessage("error yuv420-bench timeout\r\n");
+        return 1;
+    }
+    char message[160];
+    snprintf(message, sizeof(message),
+             "yuv420-bench %d %d q%d 422 %lu %lu %lu 420 %lu %lu %lu converted %lu %lu %lu\r\n",
+             result.width, result.height, result.quality,
+             result.yuv422.convert_us, result.yuv422.encode_us, result.yuv422.bytes,
+             result.yuv420.convert_us, result.yuv420.encode_us, result.yuv420.bytes,
+             result.converted.convert_us, result.converted.encode_us, result.converted.bytes);
+    uartOutputMessage(message);
+    return 0;
+}
+
+/**
+ * motion on|off|<threshold %>, replies with the current state and "<checked> <skipped> <last changed %> <avg us>".
+ */
+int motionCommand(char* commandLine, unsigned int startPosition) {
+    char argument[MAX_ARGUMENT_LENGTH];
+    bool isString;
+    extractLexeme(startPosition, strlen(commandLine), commandLine, argument, &isString);
+    if (strcmp(argument, "on") == 0) {
+        motion_set_enabled(true);
+    } else if (strcmp(argument, "off") == 0) {
+        motion_set_enabled(false);
+    } else if (argument[0] >= '0' && argument[0] <= '9' && atoi(argument) <= 100) {
+        motion_set_threshold(atoi(argument));
+    } else if (argument[0] != '\0') {
+        uartOutputMessage("error motion on|off|<threshold 0-100>\r\n");
+        return 1;
+    }
+    motion_stats_t stats;
+    motion_get_stats(&stats);
+    char message[96];
+    snprintf(message, sizeof(message), "motion %s %d %lu %lu %d %lu\r\n", stats.enabled ? "on" : "off",
+             stats.threshold, stats.checked, stats.skipped, stats.last_changed, stats.avg_check_us);
+    uartOutputMessage(message);
+    return 0;
+}
+
+/**
+ * sched-profile [<name>]: switches the task scheduling profile (saved, core placement from the next boot).
+ * No arguments: query.
+ */
+int schedProfileCommand(char* commandLine, unsigned int startPosition) {
+    char argument[MAX_ARGUMENT_LENGTH];
+    bool isString;
+    extractLexeme(startPosition, strlen(commandLine), commandLine, argument, &isString);
+    char message[80];
+    if (argument[0] != '\0') {
+        const sched_profile_t *profile = sched_find_profile(argument);
+        if (profile == NULL) {
+            char names[56];
+            sched_list_profiles(names, sizeof(names), "|");
+            snprintf(message, sizeof(message), "error sched-profile %s\r\n", names);
+            uartOutputMessage(message);
+            return 1;
+        }
+        sched_set_profile(profile);
+    }
+    snprintf(message, sizeof(message), "sched-profile %s\r\n", sched_get_profile()->name);
+    uartOutputMessage(message);
+    return 0;
+}
+
+/**
+ * cpu-stats [<window ms>]: CPU time of every task over the window (default 1000 ms), one line per task:
+ * "cpu <task> <core|-> <priority> <% of one core>". IDLE0/IDLE1 show what is left per core.
+ */
+int cpuStatsCommand(char* commandLine, unsigned int startPosition) {
+    char argument[MAX_ARGUMENT_LENGTH];
+    bool isString;
+    extractLexeme(startPosition, strlen(commandLine), commandLine, argument, &isString);
+    const int window_ms = argument[0] != '\0' ? atoi(argument) : 1000;
+    if (window_ms <= 0 || window_ms > 10000) {
+        uartOutputMessage("error cpu-stats [<window ms 1-10000>]\r\n");
+        return 1;
+    }
+    sched_task_stats_t *before = malloc(2 * SCHED_MAX_STATS_TASKS * sizeof(sched_task_stats_t));
+    if (before == NULL) {
+        uartOutputMessage("error cpu-stats out of memory\r\n");
+        return 1;
+    }
+    sched_task_stats_t *after = before + SCHED_MAX_STATS_TASKS;
+
+    const int before_count = sched_get_task_stats(before, SCHED_MAX_STATS_TASKS);
+    const int64_t start_time = esp_timer_get_time();
+    vTaskDelay(pdMS_TO_TICKS(window_ms));
+    const int after_count = sched_get_task_stats(after, SCHED_MAX_STATS_TASKS);
+    const uint32_t elapsed_us = esp_timer_get_time() - start_time;
+    if (before_count == 0 || after_count == 0) {
+        free(before);
+        uartOutputMessage("error cpu-stats needs CONFIG_FREERTOS_GENERATE_RUN_TIME_STATS\r\n");
+        return 1;
+    }
+
+    char message[80];
+    snprintf(message, sizeof(message), "cpu-stats %lu ms, profile %s\r\n", elapsed_us / 1000,
+             sched_get_profile()->name);
+    uartOutputMessage(message);
+    for (int i = 0; i < after_count; i++) {
+        uint32_t runtime_us = after[i].runtime_us; // A task created within the window counts from its start
+        for (int j = 0; j < before_count; j++) {
+            if (before[j].handle == after[i].handle) {
+                runtime_us -= before[j].runtime_us;
+                break;
+            }
+        }
+        const uint32_t permille = (uint64_t)runtime_us * 1000 / elapsed_us;
+        char core[4] = "-";
+        if (after[i].core >= 0) {
+            snprintf(core, sizeof(core), "%d", after[i].core);
+        }
+        snprintf(message, sizeof(message), "cpu %s %s %u %lu.%lu\r\n", after[i].name, core, after[i].priority,
+                 permille / 10, permille % 10);
+        uartOutputMessage(message);
+    }
+    free(before);
+    return 0;
+}
+
+static void outputConfigEntry(const char *key) {
+    char value[CONFIG_STORE_PASSWORD_SIZE];
+    config_store_format(key, value, sizeof(value));
+    char message[MAX_ARGUMENT_LENGTH + CONFIG_STORE_PASSWORD_SIZE + 16];
+    snprintf(message, sizeof(message), "config %s %s\r\n", key, value);
+    uartOutputMessage(message);
+}
+
+/**
+ * config [<key> [<value>]] | reset: a saved setting, applied to the running pipeline at once. No arguments: all of
+ * them, one line each. reset erases them, the defaults apply from the next boot.
+ */
+int configCommand(char* commandLine, unsigned int startPosition) {
+    const unsigned int length = strlen(commandLine);
+    char key[MAX_ARGUMENT_LENGTH];
+    char value[MAX_ARGUMENT_LENGTH];
+    bool isString;
+    const unsigned int position = extractLexeme(startPosition, length, commandLine, key, &isString);
+    if (key[0] == '\0') {
+        for (int i = 0; config_store_key(i) != NULL; i++) {
+            outputConfigEntry(config_store_key(i));
+        }
+        return 0;
+    }
+    if (strcmp(key, "reset") == 0) {
+        if (config_store_reset() != ESP_OK) {
+            uartOutputMessage("error config reset failed\r\n");
+            return 1;
+        }
+        uartOutputMessage("config reset\r\n");
+        return 0;
+    }
+
+    isString = false; // Not set when there is no value; "" sets an empty one
+    extractLexeme(position, length, commandLine, value, &isString);
+    const esp_err_t err = value[0] != '\0' || isString ? config_store_set(key, value)
+                        : config_store_format(key, value, sizeof(value));
+    char message[MAX_ARGUMENT_LENGTH + 32];
+    if (err == ESP_ERR_NOT_FOUND) {
+        snprintf(message, sizeof(message), "error config unknown key %s\r\n", key);
+        uartOutputMessage(message);
+        return 1;
+    }
+    if (err != ESP_OK) {
+        snprintf(message, sizeof(message), "error config %s %s\r\n", key,
+                 err == ESP_ERR_INVALID_ARG ? "invalid value" : esp_err_to_name(err));
+        uartOutputMessage(message);
+        return 1;
+    }
+    outputConfigEntry(key);
+    return 0;
+}
+
+/**
+ * wifi-params <ssid> [<password>]: saves the credentials and reconnects with them (no password: open network).
+ * No arguments: query.
+ */
+int wifiParamsCommand(char* commandLine, unsigned int startPosition) {
+    const unsigned int length = strlen(commandLine);
+    char ssid[MAX_ARGUMENT_LENGTH];
+    char password[MAX_ARGUMENT_LENGTH];
+    bool isString;
+    const unsigned int position = extractLexeme(startPosition, length, commandLine, ssid, &isString);
+    if (ssid[0] != '\0') {
+        extractLexeme(position, length, commandLine, password, &isString);
+        if (config_store_set_wifi(ssid, password) != ESP_OK) {
+            uartOutputMessage("error wifi-params <ssid up to 32> [<password up to 64>]\r\n");
+            return 1;
+        }
+    }
+    char message[MAX_ARGUMENT_LENGTH + 16];
+    snprintf(message, sizeof(message), "wifi-params %s\r\n", config_store_get()->ssid);
+    uartOutputMessage(message);
+    return 0;
+}
+
 CommandEntry command_table[] = {
     {"ping-camera", pingCameraCommand},
+    {"pool-stats", poolStatsCommand},
+    {"low-latency", lowLatencyCommand},
+    {"video-mode", videoModeCommand},
+    {"roi", roiCommand},
+    {"yuv420", yuv420Command},
+    {"yuv420-bench", yuv420BenchCommand},
+    {"motion", motionCommand},
+    {"sched-profile", schedProfileCommand},
+    {"cpu-stats", cpuStatsCommand},
+    {"config", configCommand},
+    {"wifi-params", wifiParamsCommand},
     {NULL, NULL}
 };
 
@@ -1,5 +1,16 @@
 #include "mimi_common.h"
 
+#include <stdatomic.h>
+
+#include "esp_log.h"
+#include "esp_timer.h"
+
 const char *TAG_MIMI = "mimi_video";
 
-QueueHandle_t frame_queue;
\ No newline at end of file
+static atomic_llong last_boot_mark_us;
+
+void boot_mark(const char *phase) {
+    const int64_t now = esp_timer_get_time();
+    const int64_t previous = atomic_exchange(&last_boot_mark_us, now);
+    ESP_LOGI(TAG_MIMI, "Boot %5lld ms (+%lld ms): %s", now / 1000, (now - previous) / 1000, phase);
+}
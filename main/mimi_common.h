@@ -3,26 +3,21 @@
 
 // ReSharper disable once CppUnusedIncludeDirective
 #include "freertos/FreeRTOS.h"
-#include "freertos/queue.h"
 
-#define CAMERA_TASK_CORE_ID 0
-#define CAMERA_TASK_PRIORITY 10
+// Task cores and priorities come from the scheduling profile, see mimi_sched.h
 
-#define ENCODING_TASK_CORE_ID 1
-#define ENCODING_TASK_PRIORITY 5
-
-#define STREAMING_TASK_CORE_ID 1
-#define STREAMING_TASK_PRIORITY 5
-
-#define UART_TASK_CORE_ID 0
-#define UART_TASK_PRIORITY 6
 #define UART_PORT UART_NUM_0
 // #define UART_TX_PIN 43
 // #define UART_RX_PIN 44
-#define UART_BUF_SIZE 80
+// Longest command line with its terminator: fits wifi-params with a 32-character SSID and a 64-character password
+#define UART_BUF_SIZE 128
 
 extern const char *TAG_MIMI;
 
-extern QueueHandle_t frame_queue;
+/**
+ * Boot timeline: logs `phase` with the time since startup and since the previous mark. Phases may come from
+ * different tasks, the boot steps run concurrently.
+ */
+void boot_mark(const char *phase);
 
 #endif //MIMI_COMMON_H
@@ -0,0 +1,374 @@
+#include "mimi_config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "esp_log.h"
+#include "mimi_common.h"
+#include "mimi_motion.h"
+#include "mimi_wifi.h"
+#include "nvs.h"
+
+typedef enum {
+    CONFIG_TYPE_STRING,
+    CONFIG_TYPE_INT,
+    CONFIG_TYPE_BOOL,        // on|off
+    CONFIG_TYPE_SUBSAMPLING, // 422|420|444|gray
+    CONFIG_TYPE_RESOLUTION,  // <width>x<height> of a camera_video_mode_t, one key: only pairs are valid modes
+} config_type_t;
+
+// What a change has to be pushed into
+typedef enum {
+    CONFIG_APPLY_WIFI,
+    CONFIG_APPLY_VIDEO_MODE,
+    CONFIG_APPLY_LOW_LATENCY,
+    CONFIG_APPLY_MOTION,
+} config_apply_t;
+
+typedef struct {
+    const char *name;
+    const char *nvs_key;     // At most 15 characters
+    config_type_t type;
+    size_t offset;           // In mimi_config_t
+    size_t size;
+    uint16_t min;            // CONFIG_TYPE_INT only
+    uint16_t max;
+    config_apply_t apply;
+} config_entry_t;
+
+#define CONFIG_FIELD(field) offsetof(mimi_config_t, field), sizeof(((mimi_config_t *)0)->field)
+
+static const config_entry_t entries[] = {
+    {"ssid", "wifi_ssid", CONFIG_TYPE_STRING, CONFIG_FIELD(ssid), 0, 0, CONFIG_APPLY_WIFI},
+    {"password", "wifi_password", CONFIG_TYPE_STRING, CONFIG_FIELD(password), 0, 0, CONFIG_APPLY_WIFI},
+    {"resolution", "resolution", CONFIG_TYPE_RESOLUTION, CONFIG_FIELD(video_mode), 0, 0, CONFIG_APPLY_VIDEO_MODE},
+    {"quality", "quality", CONFIG_TYPE_INT, CONFIG_FIELD(video_mode.quality), 0, 100, CONFIG_APPLY_VIDEO_MODE},
+    {"subsampling", "subsampling", CONFIG_TYPE_SUBSAMPLING, CONFIG_FIELD(video_mode.subsampling), 0, 0,
+     CONFIG_APPLY_VIDEO_MODE},
+    {"max-fps", "max_fps", CONFIG_TYPE_INT, CONFIG_FIELD(video_mode.max_fps), 0, CAMERA_MAX_FPS,
+     CONFIG_APPLY_VIDEO_MODE},
+    {"low-latency", "low_latency", CONFIG_TYPE_BOOL, CONFIG_FIELD(low_latency), 0, 0, CONFIG_APPLY_LOW_LATENCY},
+    {"motion", "motion", CONFIG_TYPE_BOOL, CONFIG_FIELD(motion), 0, 0, CONFIG_APPLY_MOTION},
+    {"motion-threshold", "motion_thresh", CONFIG_TYPE_INT, CONFIG_FIELD(motion_threshold), 0, 100,
+     CONFIG_APPLY_MOTION},
+};
+
+#define ENTRY_COUNT (sizeof(entries) / sizeof(entries[0]))
+
+static const struct {
+    const char *name;
+    jpeg_subsampling_t value;
+} subsamplings[] = {
+    {"422", JPEG_SUBSAMPLE_422},
+    {"420", JPEG_SUBSAMPLE_420},
+    {"444", JPEG_SUBSAMPLE_444},
+    {"gray", JPEG_SUBSAMPLE_GRAY},
+};
+
+static mimi_config_t config;
+
+static const config_entry_t *find_entry(const char *key) {
+    for (size_t i = 0; i < ENTRY_COUNT; i++) {
+        if (strcmp(key, entries[i].name) == 0) {
+            return &entries[i];
+        }
+    }
+    return NULL;
+}
+
+static void *field_of(const mimi_config_t *cfg, const config_entry_t *entry) {
+    return (uint8_t *)cfg + entry->offset;
+}
+
+/**
+ * Integers and enums of 1, 2 or 4 bytes.
+ */
+static uint32_t read_int(const mimi_config_t *cfg, const config_entry_t *entry) {
+    const uint8_t *field = field_of(cfg, entry);
+    switch (entry->size) {
+        case 1: return *field;
+        case 2: return *(const uint16_t *)field;
+        default: return *(const uint32_t *)field;
+    }
+}
+
+static void write_int(mimi_config_t *cfg, const config_entry_t *entry, const uint32_t value) {
+    uint8_t *field = field_of(cfg, entry);
+    switch (entry->size) {
+        case 1: *field = value; break;
+        case 2: *(uint16_t *)field = value; break;
+        default: *(uint32_t *)field = value; break;
+    }
+}
+
+static bool parse_value(mimi_config_t *cfg, const config_entry_t *entry, const char *value) {
+    switch (entry->type) {
+        case CONFIG_TYPE_STRING:
+            if (strlen(value) >= entry->size) {
+                return false;
+            }
+            strcpy(field_of(cfg, entry), value);
+            return true;
+        case CONFIG_TYPE_INT: {
+            char *end;
+            const long number = strtol(value, &end, 10);
+            if (*value == '\0' || *end != '\0' || number < entry->min || number > entry->max) {
+                return false;
+            }
+            write_int(cfg, entry, number);
+            return true;
+        }
+        case CONFIG_TYPE_BOOL:
+            if (strcmp(value, "on") != 0 && strcmp(value, "off") != 0) {
+                return false;
+            }
+            *(bool *)field_of(cfg, entry) = strcmp(value, "on") == 0;
+            return true;
+        case CONFIG_TYPE_SUBSAMPLING:
+            for (size_t i = 0; i < sizeof(subsamplings) / sizeof(subsamplings[0]); i++) {
+                if (strcmp(value, subsamplings[i].name) == 0) {
+                    write_int(cfg, entry, subsamplings[i].value);
+                    return true;
+                }
+            }
+            return false;
+        case CONFIG_TYPE_RESOLUTION: {
+            char *end;
+            const long width = strtol(value, &end, 10);
+            if (end == value || *end != 'x') {
+                return false;
+            }
+            const char *height_start = end + 1;
+            const long height = strtol(height_start, &end, 10);
+            if (end == height_start || *end != '\0' || width <= 0 || width > UINT16_MAX || height <= 0 ||
+                height > UINT16_MAX) {
+                return false;
+            }
+            camera_video_mode_t *mode = field_of(cfg, entry);
+            mode->width = width;
+            mode->height = height;
+            return true;
+        }
+    }
+    return false;
+}
+
+static esp_err_t apply(const mimi_config_t *cfg, const config_apply_t target) {
+    switch (target) {
+        case CONFIG_APPLY_WIFI:
+            return wifi_set_credentials(cfg->ssid, cfg->password);
+        case CONFIG_APPLY_VIDEO_MODE: {
+            camera_video_mode_t mode;
+            camera_get_video_mode(&mode); // Keeps the region of interest and the 4:2:0 conversion
+            mode.width = cfg->video_mode.width;
+            mode.height = cfg->video_mode.height;
+            mode.quality = cfg->video_mode.quality;
+            mode.subsampling = cfg->video_mode.subsampling;
+            mode.max_fps = cfg->video_mode.max_fps;
+            return camera_reconfigure(&mode);
+        }
+        case CONFIG_APPLY_LOW_LATENCY:
+            camera_set_low_latency_mode(cfg->low_latency);
+            return ESP_OK;
+        case CONFIG_APPLY_MOTION:
+            motion_set_threshold(cfg->motion_threshold);
+            motion_set_enabled(cfg->motion);
+            return ESP_OK;
+    }
+    return ESP_ERR_INVALID_ARG;
+}
+
+static esp_err_t save_entry(nvs_handle_t nvs, const config_entry_t *entry) {
+    switch (entry->type) {
+        case CONFIG_TYPE_STRING:
+            return nvs_set_str(nvs, entry->nvs_key, field_of(&config, entry));
+        case CONFIG_TYPE_BOOL:
+            return nvs_set_u8(nvs, entry->nvs_key, *(const bool *)field_of(&config, entry));
+        case CONFIG_TYPE_RESOLUTION: {
+            const camera_video_mode_t *mode = field_of(&config, entry);
+            return nvs_set_u32(nvs, entry->nvs_key, (uint32_t)mode->width << 16 | mode->height);
+        }
+        default:
+            return nvs_set_u16(nvs, entry->nvs_key, read_int(&config, entry));
+    }
+}
+
+static void load_entry(nvs_handle_t nvs, const config_entry_t *entry) {
+    esp_err_t err;
+    switch (entry->type) {
+        case CONFIG_TYPE_STRING: {
+            size_t len = entry->size;
+            err = nvs_get_str(nvs, entry->nvs_key, field_of(&config, entry), &len);
+            break;
+        }
+        case CONFIG_TYPE_BOOL: {
+            uint8_t value;
+            err = nvs_get_u8(nvs, entry->nvs_key, &value);
+            if (err == ESP_OK) {
+                *(bool *)field_of(&config, entry) = value != 0;
+            }
+            break;
+        }
+        case CONFIG_TYPE_RESOLUTION: {
+            uint32_t value;
+            err = nvs_get_u32(nvs, entry->nvs_key, &value);
+            if (err == ESP_OK) {
+                camera_video_mode_t *mode = field_of(&config, entry);
+                mode->width = value >> 16;
+                mode->height = value & 0xFFFF;
+            }
+            break;
+        }
+        default: {
+            uint16_t value;
+            err = nvs_get_u16(nvs, entry->nvs_key, &value);
+            if (err == ESP_OK) {
+                write_int(&config, entry, value);
+            }
+            break;
+        }
+    }
+    if (err != ESP_OK && err != ESP_ERR_NVS_NOT_FOUND) {
+        ESP_LOGW(TAG_MIMI, "Failed to load setting %s (%s)", entry->name, esp_err_to_name(err));
+    }
+}
+
+static esp_err_t save(const config_entry_t *const *changed, const int count) {
+    nvs_handle_t nvs;
+    esp_err_t err = nvs_open(CONFIG_STORE_NVS_NAMESPACE, NVS_READWRITE, &nvs);
+    if (err != ESP_OK) {
+        return err;
+    }
+    for (int i = 0; i < count && err == ESP_OK; i++) {
+        err = save_entry(nvs, changed[i]);
+    }
+    if (err == ESP_OK) {
+        err = nvs_commit(nvs);
+    }
+    nvs_close(nvs);
+    return err;
+}
+
+void config_store_init(void) {
+    snprintf(config.ssid, sizeof(config.ssid), "%s", WIFI_SSID);
+    snprintf(config.password, sizeof(config.password), "%s", WIFI_PASS);
+    camera_get_video_mode(&config.video_mode);
+    config.video_mode.roi = (camera_roi_t){0};
+    config.low_latency = camera_get_low_latency_mode();
+    motion_stats_t motion;
+    motion_get_stats(&motion);
+    config.motion = motion.enabled;
+    config.motion_threshold = motion.threshold;
+
+    nvs_handle_t nvs;
+    if (nvs_open(CONFIG_STORE_NVS_NAMESPACE, NVS_READONLY, &nvs) == ESP_OK) {
+        for (size_t i = 0; i < ENTRY_COUNT; i++) {
+            load_entry(nvs, &entries[i]);
+        }
+        nvs_close(nvs);
+    }
+    // Cheap to push now; Wi-Fi and the video mode are passed to init_wifi() and init_camera()
+    apply(&config, CONFIG_APPLY_LOW_LATENCY);
+    apply(&config, CONFIG_APPLY_MOTION);
+    ESP_LOGI(TAG_MIMI, "Configuration loaded, SSID %s", config.ssid);
+}
+
+const mimi_config_t *config_store_get(void) {
+    return &config;
+}
+
+esp_err_t config_store_set(const char *key, const char *value) {
+    const config_entry_t *entry = find_entry(key);
+    if (entry == NULL) {
+        return ESP_ERR_NOT_FOUND;
+    }
+    mimi_config_t updated = config;
+    if (!parse_value(&updated, entry, value)) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    esp_err_t err = apply(&updated, entry->apply);
+    if (err != ESP_OK) {
+        return err;
+    }
+    config = updated;
+    err = save(&entry, 1);
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG_MIMI, "Failed to save setting %s (%s)", key, esp_err_to_name(err));
+    }
+    return err;
+}
+
+esp_err_t config_store_set_wifi(const char *ssid, const char *password) {
+    const config_entry_t *changed[] = {find_entry("ssid"), find_entry("password")};
+    mimi_config_t updated = config;
+    if (!parse_value(&updated, changed[0], ssid) || !parse_value(&updated, changed[1], password)) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    esp_err_t err = apply(&updated, CONFIG_APPLY_WIFI);
+    if (err != ESP_OK) {
+        return err;
+    }
+    config = updated;
+    err = save(changed, 2);
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG_MIMI, "Failed to save the Wi-Fi credentials (%s)", esp_err_to_name(err));
+    }
+    return err;
+}
+
+esp_err_t config_store_format(const char *key, char *buf, const size_t size) {
+    const config_entry_t *entry = find_entry(key);
+    if (entry == NULL) {
+        return ESP_ERR_NOT_FOUND;
+    }
+    switch (entry->type) {
+        case CONFIG_TYPE_STRING: {
+            const char *value = field_of(&config, entry);
+            const bool secret = strcmp(entry->name, "password") == 0 && value[0] != '\0';
+            snprintf(buf, size, "%s", secret ? "****" : value);
+            break;
+        }
+        case CONFIG_TYPE_BOOL:
+            snprintf(buf, size, "%s", *(const bool *)field_of(&config, entry) ? "on" : "off");
+            break;
+        case CONFIG_TYPE_RESOLUTION: {
+            const camera_video_mode_t *mode = field_of(&config, entry);
+            snprintf(buf, size, "%dx%d", mode->width, mode->height);
+            break;
+        }
+        case CONFIG_TYPE_SUBSAMPLING:
+            snprintf(buf, size, "?");
+            for (size_t i = 0; i < sizeof(subsamplings) / sizeof(subsamplings[0]); i++) {
+                if (read_int(&config, entry) == (uint32_t)subsamplings[i].value) {
+                    snprintf(buf, size, "%s", subsamplings[i].name);
+                }
+            }
+            break;
+        default:
+            snprintf(buf, size, "%lu", (unsigned long)read_int(&config, entry));
+            break;
+    }
+    return ESP_OK;
+}
+
+const char *config_store_key(const int index) {
+    return index >= 0 && index < (int)ENTRY_COUNT ? entries[index].name : NULL;
+}
+
+esp_err_t config_store_reset(void) {
+    nvs_handle_t nvs;
+    esp_err_t err = nvs_open(CONFIG_STORE_NVS_NAMESPACE, NVS_READWRITE, &nvs);
+    if (err != ESP_OK) {
+        return err;
+    }
+    // Key by key: the namespace also holds the scheduling profile
+    for (size_t i = 0; i < ENTRY_COUNT && (err == ESP_OK || err == ESP_ERR_NVS_NOT_FOUND); i++) {
+        err = nvs_erase_key(nvs, entries[i].nvs_key);
+    }
+    if (err == ESP_OK || err == ESP_ERR_NVS_NOT_FOUND) {
+        err = nvs_commit(nvs);
+    }
+    nvs_close(nvs);
+    return err;
+}
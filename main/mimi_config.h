@@ -0,0 +1,65 @@
+#ifndef MIMI_CONFIG_H
+#define MIMI_CONFIG_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "esp_err.h"
+#include "mimi_camera.h"
+
+#define CONFIG_STORE_NVS_NAMESPACE "mimi"  // Shared with the scheduling profile, keys don't overlap
+#define CONFIG_STORE_SSID_SIZE 33          // wifi_sta_config_t limits, terminator included
+#define CONFIG_STORE_PASSWORD_SIZE 65
+
+/**
+ * Per-device settings, loaded from NVS once at boot. Defaults are the compile-time values of the modules the
+ * settings belong to.
+ */
+typedef struct {
+    char ssid[CONFIG_STORE_SSID_SIZE];
+    char password[CONFIG_STORE_PASSWORD_SIZE];
+    camera_video_mode_t video_mode;  // Region of interest and 4:2:0 conversion are not stored
+    bool low_latency;
+    bool motion;
+    uint8_t motion_threshold;
+} mimi_config_t;
+
+/**
+ * Loads the saved settings over the defaults. Call after nvs_flash_init() and before init_wifi() and init_camera().
+ */
+void config_store_init(void);
+
+/**
+ * The settings in effect. Changed by config_store_set() only, which runs on the UART task.
+ */
+const mimi_config_t *config_store_get(void);
+
+/**
+ * Parses `value` for setting `key`, pushes it into the running pipeline and saves it. Nothing is saved if the
+ * value is invalid (ESP_ERR_INVALID_ARG), the key unknown (ESP_ERR_NOT_FOUND) or the pipeline rejects it.
+ */
+esp_err_t config_store_set(const char *key, const char *value);
+
+/**
+ * Sets both Wi-Fi credentials at once and reconnects with them.
+ */
+esp_err_t config_store_set_wifi(const char *ssid, const char *password);
+
+/**
+ * Writes the value of `key` as config_store_set() takes it; the password is masked. ESP_ERR_NOT_FOUND for an
+ * unknown key.
+ */
+esp_err_t config_store_format(const char *key, char *buf, size_t size);
+
+/**
+ * The name of setting `index`, NULL past the last one.
+ */
+const char *config_store_key(int index);
+
+/**
+ * Erases the saved settings, the defaults apply from the next boot.
+ */
+esp_err_t config_store_reset(void);
+
+#endif //MIMI_CONFIG_H
@@ -0,0 +1,249 @@
+#include "mimi_frame_bus.h"
+
+#include <string.h>
+
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "mimi_common.h"
+#include "mimi_metrics.h"
+#include "freertos/queue.h"
+#include "freertos/semphr.h"
+
+struct frame_subscriber {
+    QueueHandle_t queue;
+    TaskHandle_t task;
+    frame_bus_wake_fn wake;   // NULL: notify the task
+    void *wake_ctx;
+    frame_bus_policy_t policy;
+    bool active;
+    uint8_t publishing;       // Blocking deliveries in progress outside the bus mutex, the slot is not reused until 0
+};
+
+static const char *policy_names[FRAME_BUS_POLICY_COUNT] = {"latest", "drop-newest", "block"};
+static const metric_stage_t queue_age_stages[FRAME_BUS_POLICY_COUNT] = {
+    METRIC_STAGE_QUEUE_AGE_LATEST, METRIC_STAGE_QUEUE_AGE_DROP_NEWEST, METRIC_STAGE_QUEUE_AGE_BLOCK,
+};
+
+static frame_subscriber_t subscribers[FRAME_BUS_MAX_SUBSCRIBERS];
+static SemaphoreHandle_t bus_mutex;
+static jpeg_frame_t *latest_frame;
+static TaskHandle_t demand_task;
+
+static void wake_subscriber(const frame_subscriber_t *subscriber) {
+    if (subscriber->wake != NULL) {
+        subscriber->wake(subscriber->wake_ctx);
+    } else {
+        xTaskNotifyGive(subscriber->task);
+    }
+}
+
+static void drain_subscriber_queue(const frame_subscriber_t *subscriber) {
+    jpeg_frame_t *frame;
+    while (xQueueReceive(subscriber->queue, &frame, 0) == pdTRUE) {
+        jpeg_frame_release(frame);
+    }
+}
+
+void frame_bus_init(void) {
+    bus_mutex = xSemaphoreCreateMutex();
+    for (int i = 0; i < FRAME_BUS_MAX_SUBSCRIBERS; i++) {
+        subscribers[i].queue = xQueueCreate(FRAME_BUS_SUBSCRIBER_QUEUE_SIZE, sizeof(jpeg_frame_t *));
+        subscribers[i].active = false;
+        subscribers[i].publishing = 0;
+    }
+}
+
+frame_subscriber_t *frame_bus_subscribe(void) {
+    frame_subscriber_t *subscriber = NULL;
+    xSemaphoreTake(bus_mutex, portMAX_DELAY);
+    for (int i = 0; i < FRAME_BUS_MAX_SUBSCRIBERS; i++) {
+        if (!subscribers[i].active && subscribers[i].publishing == 0) {
+            subscriber = &subscribers[i];
+            subscriber->task = xTaskGetCurrentTaskHandle();
+            subscriber->wake = NULL;
+            subscriber->policy = FRAME_BUS_DEFAULT_POLICY;
+            subscriber->active = true;
+            break;
+        }
+    }
+    xSemaphoreGive(bus_mutex);
+
+    if (subscriber == NULL) {
+        ESP_LOGW(TAG_MIMI, "No free frame bus subscriber slots");
+    } else if (demand_task != NULL) {
+        xTaskNotifyGive(demand_task);
+    }
+    return subscriber;
+}
+
+void frame_bus_unsubscribe(frame_subscriber_t *subscriber) {
+    xSemaphoreTake(bus_mutex, portMAX_DELAY);
+    subscriber->active = false;
+    drain_subscriber_queue(subscriber);
+    xSemaphoreGive(bus_mutex);
+}
+
+void frame_bus_set_policy(frame_subscriber_t *subscriber, const frame_bus_policy_t policy) {
+    xSemaphoreTake(bus_mutex, portMAX_DELAY);
+    subscriber->policy = policy;
+    xSemaphoreGive(bus_mutex);
+}
+
+void frame_bus_set_wake(frame_subscriber_t *subscriber, const frame_bus_wake_fn wake, void *ctx) {
+    xSemaphoreTake(bus_mutex, portMAX_DELAY);
+    subscriber->wake = wake;
+    subscriber->wake_ctx = ctx;
+    xSemaphoreGive(bus_mutex);
+}
+
+bool frame_bus_parse_policy(const char *name, frame_bus_policy_t *policy) {
+    for (int i = 0; i < FRAME_BUS_POLICY_COUNT; i++) {
+        if (strcmp(name, policy_names[i]) == 0) {
+            *policy = (frame_bus_policy_t)i;
+            return true;
+        }
+    }
+    return false;
+}
+
+const char *frame_bus_policy_name(const frame_bus_policy_t policy) {
+    return policy < FRAME_BUS_POLICY_COUNT ? policy_names[policy] : "?";
+}
+
+uint32_t frame_bus_subscriber_count(void) {
+    uint32_t count = 0;
+    for (int i = 0; i < FRAME_BUS_MAX_SUBSCRIBERS; i++) {
+        if (subscribers[i].active) {
+            count++;
+        }
+    }
+    return count;
+}
+
+void frame_bus_set_demand_task(const TaskHandle_t task) {
+    demand_task = task;
+}
+
+/**
+ * Queues the frame for one subscriber according to `policy`, returns true if it was queued. Called with the bus
+ * mutex held, except for FRAME_BUS_POLICY_BLOCK, which may wait.
+ */
+static bool deliver(const int index, frame_subscriber_t *subscriber, const frame_bus_policy_t policy,
+                    jpeg_frame_t *frame) {
+    // Take the reference before the frame becomes visible: the subscriber may release it right away.
+    jpeg_frame_retain(frame);
+    TickType_t wait = 0;
+    if (policy == FRAME_BUS_POLICY_LATEST) {
+        jpeg_frame_t *stale;
+        if (xQueueReceive(subscriber->queue, &stale, 0) == pdTRUE) {
+            jpeg_frame_release(stale);
+            metrics_count(METRIC_COUNTER_REPLACED_LATEST);
+        }
+    } else if (policy == FRAME_BUS_POLICY_BLOCK && uxQueueSpacesAvailable(subscriber->queue) == 0) {
+        metrics_count(METRIC_COUNTER_PUBLISH_BLOCKED);
+        wait = pdMS_TO_TICKS(FRAME_BUS_BLOCK_TIMEOUT_MS);
+    }
+
+    const int64_t start_time = esp_timer_get_time();
+    if (xQueueSend(subscriber->queue, &frame, wait) != pdTRUE) {
+        jpeg_frame_release(frame);
+        if (policy == FRAME_BUS_POLICY_BLOCK) {
+            metrics_count(METRIC_COUNTER_DROPPED_BLOCK_TIMEOUT);
+            ESP_LOGW(TAG_MIMI, "Subscriber %d took no frame for %d ms, dropping frame", index,
+                     FRAME_BUS_BLOCK_TIMEOUT_MS);
+        } else {
+            metrics_count(METRIC_COUNTER_DROPPED_QUEUE_FULL);
+            ESP_LOGD(TAG_MIMI, "Subscriber %d queue full, dropping frame. Frame size: %u bytes.", index,
+                     frame->fb.len);
+        }
+        return false;
+    }
+    if (wait > 0) {
+        metrics_record(METRIC_STAGE_PUBLISH_BLOCKED, esp_timer_get_time() - start_time);
+    }
+    return true;
+}
+
+void frame_bus_publish(jpeg_frame_t *frame) {
+    int blocking[FRAME_BUS_MAX_SUBSCRIBERS];
+    int blocking_count = 0;
+    xSemaphoreTake(bus_mutex, portMAX_DELAY);
+    for (int i = 0; i < FRAME_BUS_MAX_SUBSCRIBERS; i++) {
+        frame_subscriber_t *subscriber = &subscribers[i];
+        if (!subscriber->active) {
+            continue;
+        }
+        if (subscriber->policy == FRAME_BUS_POLICY_BLOCK) {
+            subscriber->publishing++;
+            blocking[blocking_count++] = i;
+        } else if (deliver(i, subscriber, subscriber->policy, frame)) {
+            wake_subscriber(subscriber);
+        }
+    }
+    xSemaphoreGive(bus_mutex);
+
+    // Blocking subscribers last and without the mutex: waiting for one delays neither the others nor
+    // subscribing and unsubscribing, which is how a stuck subscriber's queue gets drained
+    for (int n = 0; n < blocking_count; n++) {
+        frame_subscriber_t *subscriber = &subscribers[blocking[n]];
+        const bool queued = deliver(blocking[n], subscriber, FRAME_BUS_POLICY_BLOCK, frame);
+        xSemaphoreTake(bus_mutex, portMAX_DELAY);
+        subscriber->publishing--;
+        if (!subscriber->active) {
+            drain_subscriber_queue(subscriber); // Unsubscribed during the wait, after its queue was drained
+        } else if (queued) {
+            wake_subscriber(subscriber);
+        }
+        xSemaphoreGive(bus_mutex);
+    }
+}
+
+void frame_bus_set_latest(jpeg_frame_t *frame) {
+    jpeg_frame_retain(frame);
+    xSemaphoreTake(bus_mutex, portMAX_DELAY);
+    jpeg_frame_t *previous = latest_frame;
+    latest_frame = frame;
+    xSemaphoreGive(bus_mutex);
+    if (previous != NULL) {
+        jpeg_frame_release(previous);
+    }
+}
+
+jpeg_frame_t *frame_bus_get_latest(void) {
+    xSemaphoreTake(bus_mutex, portMAX_DELAY);
+    jpeg_frame_t *frame = latest_frame;
+    if (frame != NULL) {
+        jpeg_frame_retain(frame);
+    }
+    xSemaphoreGive(bus_mutex);
+    return frame;
+}
+
+void frame_bus_notify_progress(void) {
+    xSemaphoreTake(bus_mutex, portMAX_DELAY);
+    for (int i = 0; i < FRAME_BUS_MAX_SUBSCRIBERS; i++) {
+        if (subscribers[i].active) {
+            wake_subscriber(&subscribers[i]);
+        }
+    }
+    xSemaphoreGive(bus_mutex);
+}
+
+uint32_t frame_bus_max_queued(void) {
+    uint32_t max_queued = 0;
+    for (int i = 0; i < FRAME_BUS_MAX_SUBSCRIBERS; i++) {
+        if (subscribers[i].active) {
+            const uint32_t queued = uxQueueMessagesWaiting(subscribers[i].queue);
+            max_queued = queued > max_queued ? queued : max_queued;
+        }
+    }
+    return max_queued;
+}
+
+bool frame_bus_receive(frame_subscriber_t *subscriber, jpeg_frame_t **frame, const TickType_t timeout) {
+    if (xQueueReceive(subscriber->queue, frame, timeout) != pdTRUE) {
+        return false;
+    }
+    metrics_record(queue_age_stages[subscriber->policy], esp_timer_get_time() - (*frame)->publish_time);
+    return true;
+}
@@ -0,0 +1,99 @@
+#ifndef MIMI_FRAME_BUS_H
+#define MIMI_FRAME_BUS_H
+
+#include <stdbool.h>
+
+#include "freertos/FreeRTOS.h"
+#include "mimi_camera.h"
+
+#define FRAME_BUS_MAX_SUBSCRIBERS 4
+#define FRAME_BUS_SUBSCRIBER_QUEUE_SIZE 2
+#define FRAME_BUS_BLOCK_TIMEOUT_MS 1000 // A blocking subscriber that takes nothing for this long loses the frame
+
+/**
+ * What publishing does when a subscriber hasn't taken the previous frames yet.
+ */
+typedef enum {
+    FRAME_BUS_POLICY_LATEST,      // Single-slot mailbox: the new frame replaces the one waiting (live viewing)
+    FRAME_BUS_POLICY_DROP_NEWEST, // Up to FRAME_BUS_SUBSCRIBER_QUEUE_SIZE waiting, the new frame is dropped
+    FRAME_BUS_POLICY_BLOCK,       // Up to FRAME_BUS_SUBSCRIBER_QUEUE_SIZE waiting, the encoder waits (recording)
+    FRAME_BUS_POLICY_COUNT
+} frame_bus_policy_t;
+
+#define FRAME_BUS_DEFAULT_POLICY FRAME_BUS_POLICY_LATEST
+
+/**
+ * Broadcast distributor for encoded frames. Every subscriber (a /stream client etc.) reads each published frame
+ * through its own queue. A frame goes back to the JPEG frame pool after the last subscriber released it.
+ */
+typedef struct frame_subscriber frame_subscriber_t;
+
+void frame_bus_init(void);
+
+/**
+ * Subscribes the calling task: it gets a task notification for every frame in its queue and for every stripe
+ * encoded into a streaming frame, so call it from the task that receives (or set a wake function with
+ * frame_bus_set_wake()). Returns NULL if all FRAME_BUS_MAX_SUBSCRIBERS slots are taken. The subscriber
+ * starts with FRAME_BUS_DEFAULT_POLICY.
+ */
+frame_subscriber_t *frame_bus_subscribe(void);
+void frame_bus_unsubscribe(frame_subscriber_t *subscriber);
+
+void frame_bus_set_policy(frame_subscriber_t *subscriber, frame_bus_policy_t policy);
+
+typedef void (*frame_bus_wake_fn)(void *ctx);
+
+/**
+ * Replaces the task notification the subscriber gets for new frames and stripes with `wake`, e.g. for a task
+ * that waits in select(). Called from the publishing task; NULL restores the task notification.
+ */
+void frame_bus_set_wake(frame_subscriber_t *subscriber, frame_bus_wake_fn wake, void *ctx);
+
+/**
+ * Parses "latest", "drop-newest" or "block". Returns false for anything else.
+ */
+bool frame_bus_parse_policy(const char *name, frame_bus_policy_t *policy);
+const char *frame_bus_policy_name(frame_bus_policy_t policy);
+
+uint32_t frame_bus_subscriber_count(void);
+
+/**
+ * `task` gets a task notification whenever a subscriber arrives (the camera task, to wake up an idle pipeline).
+ */
+void frame_bus_set_demand_task(TaskHandle_t task);
+
+/**
+ * Hands the frame to every subscriber according to its policy; with FRAME_BUS_POLICY_BLOCK subscribers this may
+ * wait up to FRAME_BUS_BLOCK_TIMEOUT_MS for each of them, without holding up the rest of the bus. Each delivery
+ * holds its own frame reference, the caller keeps (and later releases) its own.
+ */
+void frame_bus_publish(jpeg_frame_t *frame);
+
+/**
+ * Caches a complete frame as the latest one (see frame_bus_get_latest()), replacing the previous one.
+ */
+void frame_bus_set_latest(jpeg_frame_t *frame);
+
+/**
+ * Returns the latest complete frame with a reference the caller must release, NULL if there is none yet.
+ * Doesn't take anything from the subscribers.
+ */
+jpeg_frame_t *frame_bus_get_latest(void);
+
+/**
+ * Wakes up subscribers waiting for more bytes of a streaming frame (see frame_pool_mark_streaming()).
+ */
+void frame_bus_notify_progress(void);
+
+/**
+ * Returns the number of frames waiting in the fullest subscriber queue.
+ */
+uint32_t frame_bus_max_queued(void);
+
+/**
+ * On success the caller owns a frame reference and must call jpeg_frame_release() when done with the frame.
+ * Records the frame's queue age for the subscriber's policy.
+ */
+bool frame_bus_receive(frame_subscriber_t *subscriber, jpeg_frame_t **frame, TickType_t timeout);
+
+#endif //MIMI_FRAME_BUS_H
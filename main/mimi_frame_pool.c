@@ -0,0 +1,164 @@
+#include "mimi_frame_pool.h"
+
+#include "esp_heap_caps.h"
+#include "esp_log.h"
+#include "mimi_common.h"
+
+// The free list is a lock-free stack (frames are released from several tasks). Its head packs the index of the
+// top frame into the low byte and a tag into the upper bytes. The tag changes on every update, so a compare-and-swap
+// never succeeds against a head that was popped and pushed back in between (the ABA problem).
+#define FREE_LIST_EMPTY 0xFF
+#define FREE_LIST_INDEX(head) ((uint8_t)((head) & 0xFF))
+#define FREE_LIST_HEAD(tag, index) ((((tag) + 1) << 8) | (index))
+
+static jpeg_frame_t jpeg_pool[JPEG_FRAME_POOL_SIZE];
+static atomic_uint free_head = FREE_LIST_EMPTY;
+static atomic_uint pool_buf_size;
+
+static atomic_uint acquired_count;
+static atomic_uint exhausted_count;
+static atomic_uint in_use_count;
+static atomic_uint max_in_use_count;
+
+static void free_list_push(jpeg_frame_t *frame) {
+    unsigned int head = atomic_load(&free_head);
+    do {
+        frame->next_free = FREE_LIST_INDEX(head);
+    } while (!atomic_compare_exchange_weak(&free_head, &head, FREE_LIST_HEAD(head >> 8, frame->index)));
+}
+
+static jpeg_frame_t *free_list_pop(void) {
+    unsigned int head = atomic_load(&free_head);
+    jpeg_frame_t *frame;
+    do {
+        if (FREE_LIST_INDEX(head) == FREE_LIST_EMPTY) {
+            return NULL;
+        }
+        frame = &jpeg_pool[FREE_LIST_INDEX(head)];
+    } while (!atomic_compare_exchange_weak(&free_head, &head, FREE_LIST_HEAD(head >> 8, frame->next_free)));
+    return frame;
+}
+
+esp_err_t frame_pool_init(const size_t buf_size) {
+    atomic_store(&pool_buf_size, buf_size);
+    for (int i = 0; i < JPEG_FRAME_POOL_SIZE; i++) {
+        jpeg_frame_t *frame = &jpeg_pool[i];
+        uint8_t *buf = heap_caps_aligned_alloc(JPEG_FRAME_ALIGNMENT, JPEG_FRAME_HEADROOM + buf_size, MALLOC_CAP_SPIRAM);
+        if (buf == NULL) {
+            ESP_LOGE(TAG_MIMI, "Failed to allocate JPEG frame %d", i);
+            for (int j = 0; j < i; j++) {
+                heap_caps_free(jpeg_pool[j].fb.buf - JPEG_FRAME_HEADROOM);
+                jpeg_pool[j].fb.buf = NULL;
+            }
+            atomic_store(&free_head, FREE_LIST_EMPTY);
+            return ESP_ERR_NO_MEM;
+        }
+        frame->fb.buf = buf + JPEG_FRAME_HEADROOM;
+        frame->buf_size = buf_size;
+        frame->fb.len = 0;
+        frame->fb.width = 0;
+        frame->fb.height = 0;
+        frame->fb.format = PIXFORMAT_JPEG;
+        atomic_init(&frame->refs, 0);
+        atomic_init(&frame->state, JPEG_FRAME_FREE);
+        atomic_init(&frame->encoded_len, 0);
+        frame->generation = 0;
+        frame->index = i;
+        free_list_push(frame);
+    }
+    return ESP_OK;
+}
+
+void frame_pool_resize(const size_t buf_size) {
+    atomic_store(&pool_buf_size, buf_size);
+}
+
+/**
+ * Reallocates the buffer of a frame nobody else holds. On failure the frame keeps its old buffer, an encode
+ * into it just fails if the JPEG doesn't fit.
+ */
+static void resize_frame_buffer(jpeg_frame_t *frame, const size_t buf_size) {
+    uint8_t *buf = heap_caps_aligned_alloc(JPEG_FRAME_ALIGNMENT, JPEG_FRAME_HEADROOM + buf_size, MALLOC_CAP_SPIRAM);
+    if (buf == NULL) {
+        ESP_LOGE(TAG_MIMI, "Failed to resize JPEG frame %d to %u bytes", frame->index, buf_size);
+        return;
+    }
+    heap_caps_free(frame->fb.buf - JPEG_FRAME_HEADROOM);
+    frame->fb.buf = buf + JPEG_FRAME_HEADROOM;
+    frame->buf_size = buf_size;
+}
+
+jpeg_frame_t *frame_pool_acquire(void) {
+    jpeg_frame_t *frame = free_list_pop();
+    if (frame == NULL) {
+        atomic_fetch_add(&exhausted_count, 1);
+        return NULL;
+    }
+
+    if (atomic_load(&frame->state) != JPEG_FRAME_FREE || atomic_load(&frame->refs) != 0) {
+        ESP_LOGE(TAG_MIMI, "JPEG frame %d (generation %lu) is in the free list but still in use",
+                 frame->index, frame->generation);
+    }
+    const size_t buf_size = atomic_load(&pool_buf_size);
+    if (frame->buf_size != buf_size) {
+        resize_frame_buffer(frame, buf_size);
+    }
+    frame->generation++;
+    frame->prefix_len = 0;
+    atomic_store(&frame->state, JPEG_FRAME_ENCODING);
+    atomic_store(&frame->encoded_len, 0);
+    atomic_store(&frame->refs, 1);
+
+    atomic_fetch_add(&acquired_count, 1);
+    const unsigned int in_use = atomic_fetch_add(&in_use_count, 1) + 1;
+    unsigned int max_in_use = atomic_load(&max_in_use_count);
+    while (in_use > max_in_use && !atomic_compare_exchange_weak(&max_in_use_count, &max_in_use, in_use)) {
+        // A failed exchange reloaded max_in_use
+    }
+    return frame;
+}
+
+void frame_pool_mark_streaming(jpeg_frame_t *frame, const int encoded_len) {
+    atomic_store(&frame->encoded_len, encoded_len);
+    atomic_store(&frame->state, JPEG_FRAME_STREAMING);
+}
+
+void frame_pool_set_encoded_len(jpeg_frame_t *frame, const int encoded_len) {
+    atomic_store(&frame->encoded_len, encoded_len);
+}
+
+void frame_pool_mark_published(jpeg_frame_t *frame) {
+    atomic_store(&frame->encoded_len, (int)frame->fb.len);
+    atomic_store(&frame->state, JPEG_FRAME_PUBLISHED);
+}
+
+bool jpeg_frame_is_complete(jpeg_frame_t *frame) {
+    return atomic_load(&frame->state) == JPEG_FRAME_PUBLISHED;
+}
+
+void jpeg_frame_retain(jpeg_frame_t *frame) {
+    atomic_fetch_add(&frame->refs, 1);
+}
+
+void jpeg_frame_release(jpeg_frame_t *frame) {
+    const int refs = atomic_fetch_sub(&frame->refs, 1);
+    if (refs > 1) {
+        return;
+    }
+    if (refs < 1) {
+        ESP_LOGE(TAG_MIMI, "JPEG frame %d (generation %lu) released more times than retained",
+                 frame->index, frame->generation);
+        atomic_fetch_add(&frame->refs, 1);
+        return;
+    }
+    atomic_store(&frame->state, JPEG_FRAME_FREE);
+    atomic_fetch_sub(&in_use_count, 1);
+    free_list_push(frame);
+}
+
+void frame_pool_get_stats(frame_pool_stats_t *stats) {
+    stats->acquired = atomic_load(&acquired_count);
+    stats->exhausted = atomic_load(&exhausted_count);
+    stats->in_use = atomic_load(&in_use_count);
+    stats->max_in_use = atomic_load(&max_in_use_count);
+}
@@ -0,0 +1,80 @@
+#ifndef MIMI_FRAME_POOL_H
+#define MIMI_FRAME_POOL_H
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "esp_camera.h"
+
+#define JPEG_FRAME_POOL_SIZE 6 // One is held by the frame bus as the latest frame for /capture
+#define JPEG_FRAME_ALIGNMENT 16 // Of the frame buffers; heap_caps_malloc() only guarantees 4 bytes in PSRAM
+#define JPEG_FRAME_HEADROOM 96  // Reserved in front of fb.buf for a transport header, multiple of JPEG_FRAME_ALIGNMENT
+
+typedef enum {
+    JPEG_FRAME_FREE,      // In the free list
+    JPEG_FRAME_ENCODING,  // Owned by the encoder
+    JPEG_FRAME_STREAMING, // Published while still being encoded stripe by stripe, fb.len is not final yet
+    JPEG_FRAME_PUBLISHED, // Read-only, queued or being sent to clients
+} jpeg_frame_state_t;
+
+typedef struct {
+    camera_fb_t fb;       // Output JPEG frame struct (for streaming)
+    size_t buf_size;      // Capacity of fb.buf
+    atomic_int refs;      // Frame returns to the free list when the last reference is released
+    atomic_int state;     // jpeg_frame_state_t
+    atomic_int encoded_len; // Bytes at the start of fb.buf that are final, grows in the STREAMING state
+    uint32_t generation;  // Incremented on every acquire, tells reuses of the same slot apart
+    int64_t capture_time; // esp_timer time the camera frame was taken, for latency metrics
+    int64_t publish_time; // esp_timer time the frame was handed to subscribers
+    uint8_t index;
+    uint8_t next_free;
+    // Bytes of the headroom in front of fb.buf filled with the multipart part header, so header and JPEG go out
+    // in one send. 0 on acquire; written once per frame, by the stream sender task only.
+    uint8_t prefix_len;
+} jpeg_frame_t;
+
+typedef struct {
+    uint32_t acquired;
+    uint32_t exhausted;   // Acquire attempts that found no free frame (the camera frame is dropped)
+    uint32_t in_use;
+    uint32_t max_in_use;  // High watermark, JPEG_FRAME_POOL_SIZE can be trimmed down to it
+} frame_pool_stats_t;
+
+esp_err_t frame_pool_init(size_t buf_size);
+
+/**
+ * Changes the buffer size for a new video mode. Frames still in use keep their buffers: every frame is
+ * reallocated on its next acquire, so a frame never changes under a reader.
+ */
+void frame_pool_resize(size_t buf_size);
+
+/**
+ * Takes a free frame and returns it in the JPEG_FRAME_ENCODING state with one reference owned by the caller.
+ * Returns NULL if every frame is still queued or in flight.
+ */
+jpeg_frame_t *frame_pool_acquire(void);
+
+/**
+ * Publishes a frame that is still being encoded. Consumers may send the first `encoded_len` bytes of fb.buf.
+ */
+void frame_pool_mark_streaming(jpeg_frame_t *frame, int encoded_len);
+void frame_pool_set_encoded_len(jpeg_frame_t *frame, int encoded_len);
+
+/**
+ * Marks an encoded frame read-only before it is handed to consumers. fb.len must be set.
+ * A streaming frame that failed to encode is marked published with fb.len == 0.
+ */
+void frame_pool_mark_published(jpeg_frame_t *frame);
+
+/**
+ * True when fb.len is final. Check it before reading encoded_len.
+ */
+bool jpeg_frame_is_complete(jpeg_frame_t *frame);
+
+void jpeg_frame_retain(jpeg_frame_t *frame);
+void jpeg_frame_release(jpeg_frame_t *frame);
+
+void frame_pool_get_stats(frame_pool_stats_t *stats);
+
+#endif //MIMI_FRAME_POOL_H
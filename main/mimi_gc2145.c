@@ -0,0 +1,86 @@
+#include "mimi_gc2145.h"
+
+#include "esp_log.h"
+#include "mimi_common.h"
+#include "sccb.h"
+
+#define REG_PAGE_SELECT 0xFE
+#define P0_ROW_START_HIGH 0x09     // Readout window in the pixel array, 16-bit registers high byte first
+#define P0_COLUMN_START_HIGH 0x0B
+#define P0_WINDOW_HEIGHT_HIGH 0x0D
+#define P0_WINDOW_WIDTH_HIGH 0x0F
+#define P0_CROP_ENABLE 0x90        // Output window after the subsampling
+#define P0_OUT_WIN_Y1_HIGH 0x91
+#define P0_OUT_WIN_X1_HIGH 0x93
+#define P0_OUT_WIN_HEIGHT_HIGH 0x95
+#define P0_OUT_WIN_WIDTH_HIGH 0x97
+#define P0_SUBSAMPLE 0x99          // Row and column ratio 1/n in the two nibbles
+
+#define WINDOW_MARGIN_ROWS 8       // Read around the output for the ISP's interpolation, as the driver does
+#define WINDOW_MARGIN_COLUMNS 16
+
+typedef struct {
+    uint8_t ratio;                 // 1/ratio
+    uint8_t reg;
+} subsample_t;
+
+// The integer ratios of the esp32-camera GC2145 driver (CONFIG_GC_SENSOR_SUBSAMPLE_MODE), strongest first.
+// All frame sizes the pipeline uses get one of them.
+static const subsample_t subsample_ratios[] = {
+    {5, 0x55},
+    {4, 0x44},
+    {3, 0x33},
+    {2, 0x22},
+    {1, 0x11},
+};
+
+/**
+ * The driver's choice for a frame size: the strongest subsampling (widest field of view) whose window fits the
+ * array, but at most 1/4 from QVGA up.
+ */
+static const subsample_t *mode_subsample(const framesize_t mode_size, const uint16_t width, const uint16_t height) {
+    const size_t count = sizeof(subsample_ratios) / sizeof(subsample_ratios[0]);
+    size_t i = mode_size >= FRAMESIZE_QVGA ? 1 : 0;
+    for (; i < count - 1; i++) {
+        if (width * subsample_ratios[i].ratio <= GC2145_ARRAY_WIDTH &&
+            height * subsample_ratios[i].ratio <= GC2145_ARRAY_HEIGHT) {
+            break;
+        }
+    }
+    return &subsample_ratios[i];
+}
+
+static int write_reg16(const uint8_t high_reg, const uint16_t value) {
+    return SCCB_Write(GC2145_SCCB_ADDR, high_reg, value >> 8) |
+           SCCB_Write(GC2145_SCCB_ADDR, high_reg + 1, value & 0xFF);
+}
+
+esp_err_t gc2145_set_window(const framesize_t mode_size, const uint16_t mode_width, const uint16_t mode_height,
+                            const camera_roi_t *roi, const bool rotated) {
+    const subsample_t *subsample = mode_subsample(mode_size, mode_width, mode_height);
+    const int ratio = subsample->ratio;
+    // The mode shows the centre of the array
+    const int mode_column = (GC2145_ARRAY_WIDTH - mode_width * ratio) / 2;
+    const int mode_row = (GC2145_ARRAY_HEIGHT - mode_height * ratio) / 2;
+    const int x = rotated ? mode_width - roi->x - roi->width : roi->x;
+    const int y = rotated ? mode_height - roi->y - roi->height : roi->y;
+
+    int err = SCCB_Write(GC2145_SCCB_ADDR, REG_PAGE_SELECT, 0x00);
+    err |= write_reg16(P0_ROW_START_HIGH, mode_row + y * ratio);
+    err |= write_reg16(P0_COLUMN_START_HIGH, mode_column + x * ratio);
+    err |= write_reg16(P0_WINDOW_HEIGHT_HIGH, roi->height * ratio + WINDOW_MARGIN_ROWS);
+    err |= write_reg16(P0_WINDOW_WIDTH_HIGH, roi->width * ratio + WINDOW_MARGIN_COLUMNS);
+    err |= SCCB_Write(GC2145_SCCB_ADDR, P0_SUBSAMPLE, subsample->reg);
+    err |= SCCB_Write(GC2145_SCCB_ADDR, P0_CROP_ENABLE, 0x01);
+    err |= write_reg16(P0_OUT_WIN_Y1_HIGH, 0);
+    err |= write_reg16(P0_OUT_WIN_X1_HIGH, 0);
+    err |= write_reg16(P0_OUT_WIN_HEIGHT_HIGH, roi->height);
+    err |= write_reg16(P0_OUT_WIN_WIDTH_HIGH, roi->width);
+    if (err != 0) {
+        ESP_LOGE(TAG_MIMI, "Failed to set the GC2145 window");
+        return ESP_FAIL;
+    }
+    ESP_LOGI(TAG_MIMI, "GC2145 window %dx%d at %d,%d (subsampling 1/%d)", roi->width * ratio, roi->height * ratio,
+             mode_column + x * ratio, mode_row + y * ratio, ratio);
+    return ESP_OK;
+}
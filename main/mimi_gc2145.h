@@ -0,0 +1,24 @@
+#ifndef MIMI_GC2145_H
+#define MIMI_GC2145_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "esp_camera.h"
+#include "mimi_camera.h"
+
+#define GC2145_SCCB_ADDR 0x3C
+#define GC2145_ARRAY_WIDTH 1600
+#define GC2145_ARRAY_HEIGHT 1200
+
+/**
+ * Sensor-side region of interest. The sensor must run at the region's frame size (esp32-camera sizes its DMA
+ * transfers and framebuffers by it); its readout window is then pointed at `roi` of the `mode_width`x`mode_height`
+ * mode started as `mode_size`, with that mode's subsampling. Only the region is read out and crosses the DVP bus,
+ * and the frames show the same pixels a software crop of the mode would.
+ * `rotated`: the sensor mirrors and flips its readout (rotation by 180°), the window is mirrored to match.
+ */
+esp_err_t gc2145_set_window(framesize_t mode_size, uint16_t mode_width, uint16_t mode_height,
+                            const camera_roi_t *roi, bool rotated);
+
+#endif //MIMI_GC2145_H
@@ -3,8 +3,9 @@
 
 #include <stdbool.h>
 
-#define MAX_MNEMONIC_LENGTH 80
-#define MAX_ARGUMENT_LENGTH 80
+// A lexeme is never longer than its line (UART_BUF_SIZE)
+#define MAX_MNEMONIC_LENGTH 128
+#define MAX_ARGUMENT_LENGTH 128
 
 unsigned int extractLexeme(
     unsigned int startPos,
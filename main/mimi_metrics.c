@@ -0,0 +1,170 @@
+#include "mimi_metrics.h"
+
+#include <inttypes.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "freertos/FreeRTOS.h"
+#include "mimi_camera.h"
+#include "mimi_frame_pool.h"
+#include "mimi_rate_control.h"
+#include "mimi_sched.h"
+#include "mimi_wifi.h"
+
+typedef struct {
+    uint32_t samples[METRICS_WINDOW_SIZE];
+    uint32_t next;
+    uint32_t count; // Total samples recorded, the window holds the latest METRICS_WINDOW_SIZE of them
+} stage_window_t;
+
+static const char *stage_names[METRIC_STAGE_COUNT] = {
+    "capture_wait", "pre_encode", "encode", "publish", "queue", "send", "total", "ws_rtt", "convert",
+    "queue_age_latest", "queue_age_drop_newest", "queue_age_block", "publish_blocked"
+};
+
+static const char *counter_names[METRIC_COUNTER_COUNT] = {
+    "mimi_frames_published_total",
+    "mimi_frames_sent_total",
+    "mimi_capture_failures_total",
+    "mimi_encode_failures_total",
+    "mimi_frames_dropped_queue_full_total",
+    "mimi_frames_dropped_ws_window_total",
+    "mimi_rtp_frames_sent_total",
+    "mimi_rtp_frames_dropped_late_total",
+    "mimi_frames_skipped_static_total",
+    "mimi_frames_replaced_latest_total",
+    "mimi_publish_blocked_total",
+    "mimi_frames_dropped_block_timeout_total",
+};
+
+static portMUX_TYPE metrics_mux = portMUX_INITIALIZER_UNLOCKED;
+static stage_window_t stage_windows[METRIC_STAGE_COUNT];
+static atomic_uint counters[METRIC_COUNTER_COUNT];
+
+// Scratch copy of a window for sorting, used only by metrics_write_prometheus() (the httpd task)
+static uint32_t sorted_samples[METRICS_WINDOW_SIZE];
+
+void metrics_record(const metric_stage_t stage, const int64_t duration_us) {
+    if (duration_us < 0) {
+        return;
+    }
+    stage_window_t *window = &stage_windows[stage];
+    portENTER_CRITICAL(&metrics_mux);
+    window->samples[window->next] = duration_us > UINT32_MAX ? UINT32_MAX : (uint32_t)duration_us;
+    window->next = (window->next + 1) % METRICS_WINDOW_SIZE;
+    window->count++;
+    portEXIT_CRITICAL(&metrics_mux);
+}
+
+void metrics_count(const metric_counter_t counter) {
+    atomic_fetch_add(&counters[counter], 1);
+}
+
+static int compare_samples(const void *a, const void *b) {
+    const uint32_t x = *(const uint32_t *)a;
+    const uint32_t y = *(const uint32_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+static uint32_t percentile(const uint32_t *sorted, const uint32_t n, const uint32_t pct) {
+    return sorted[(n - 1) * pct / 100];
+}
+
+esp_err_t metrics_write_prometheus(const metrics_emit_fn emit, void *ctx) {
+    char line[192];
+    esp_err_t err = emit(ctx, "# TYPE mimi_stage_latency_us summary\n");
+
+    for (int stage = 0; stage < METRIC_STAGE_COUNT && err == ESP_OK; stage++) {
+        const stage_window_t *window = &stage_windows[stage];
+        portENTER_CRITICAL(&metrics_mux);
+        const uint32_t count = window->count;
+        const uint32_t n = count < METRICS_WINDOW_SIZE ? count : METRICS_WINDOW_SIZE;
+        memcpy(sorted_samples, window->samples, n * sizeof(uint32_t));
+        portEXIT_CRITICAL(&metrics_mux);
+
+        if (n > 0) {
+            qsort(sorted_samples, n, sizeof(uint32_t), compare_samples);
+            snprintf(line, sizeof(line),
+                     "mimi_stage_latency_us{stage=\"%s\",quantile=\"0.5\"} %" PRIu32 "\n"
+                     "mimi_stage_latency_us{stage=\"%s\",quantile=\"0.95\"} %" PRIu32 "\n",
+                     stage_names[stage], percentile(sorted_samples, n, 50),
+                     stage_names[stage], percentile(sorted_samples, n, 95));
+            err = emit(ctx, line);
+            if (err == ESP_OK) {
+                snprintf(line, sizeof(line), "mimi_stage_latency_us{stage=\"%s\",quantile=\"0.99\"} %" PRIu32 "\n",
+                         stage_names[stage], percentile(sorted_samples, n, 99));
+                err = emit(ctx, line);
+            }
+        }
+        if (err == ESP_OK) {
+            snprintf(line, sizeof(line), "mimi_stage_latency_us_count{stage=\"%s\"} %" PRIu32 "\n",
+                     stage_names[stage], count);
+            err = emit(ctx, line);
+        }
+    }
+
+    for (int counter = 0; counter < METRIC_COUNTER_COUNT && err == ESP_OK; counter++) {
+        snprintf(line, sizeof(line), "# TYPE %s counter\n%s %u\n",
+                 counter_names[counter], counter_names[counter], atomic_load(&counters[counter]));
+        err = emit(ctx, line);
+    }
+
+    if (err == ESP_OK) {
+        frame_pool_stats_t pool;
+        frame_pool_get_stats(&pool);
+        snprintf(line, sizeof(line),
+                 "mimi_frames_dropped_pool_exhausted_total %" PRIu32 "\n"
+                 "mimi_jpeg_pool_in_use %" PRIu32 "\nmimi_jpeg_pool_max_in_use %" PRIu32 "\nmimi_jpeg_pool_size %d\n",
+                 pool.exhausted, pool.in_use, pool.max_in_use, JPEG_FRAME_POOL_SIZE);
+        err = emit(ctx, line);
+    }
+    if (err == ESP_OK) {
+        rate_control_state_t rate_control;
+        rate_control_get_state(&rate_control);
+        snprintf(line, sizeof(line),
+                 "mimi_jpeg_quality %d\nmimi_jpeg_frame_bytes %" PRIu32 "\nmimi_stream_throughput_kbps %" PRIu32 "\n"
+                 "mimi_link_budget_kbps %" PRIu32 "\n",
+                 rate_control.quality, rate_control.frame_bytes, rate_control.throughput_kbps, rate_control.link_kbps);
+        err = emit(ctx, line);
+    }
+    if (err == ESP_OK) {
+        wifi_link_stats_t link;
+        wifi_get_link_stats(&link);
+        snprintf(line, sizeof(line),
+                 "mimi_wifi_connected %d\nmimi_wifi_rssi_dbm %d\nmimi_wifi_phy_rate_kbps %" PRIu32 "\n"
+                 "mimi_wifi_disconnects_total %" PRIu32 "\n",
+                 link.connected, link.rssi, link.phy_rate_kbps, link.disconnects);
+        err = emit(ctx, line);
+    }
+    if (err == ESP_OK) {
+        camera_power_stats_t power;
+        camera_get_power_stats(&power);
+        snprintf(line, sizeof(line),
+                 "mimi_camera_active %d\nmimi_camera_wakeups_total %" PRIu32 "\n"
+                 "mimi_camera_time_to_first_frame_ms %" PRIu32 "\nmimi_camera_idle_seconds_total %" PRIu32 "\n",
+                 power.active, power.wakeups, power.time_to_first_frame_ms, (uint32_t)(power.idle_ms / 1000));
+        err = emit(ctx, line);
+    }
+    if (err == ESP_OK) {
+        snprintf(line, sizeof(line), "mimi_camera_sensor_fps %" PRIu32 "\n", camera_get_sensor_fps());
+        err = emit(ctx, line);
+    }
+
+    // Per-task CPU time: rate() over it is the task's share of a core
+    sched_task_stats_t *tasks = err == ESP_OK ? malloc(SCHED_MAX_STATS_TASKS * sizeof(sched_task_stats_t)) : NULL;
+    if (tasks != NULL) {
+        const int task_count = sched_get_task_stats(tasks, SCHED_MAX_STATS_TASKS);
+        if (task_count > 0) {
+            err = emit(ctx, "# TYPE mimi_task_runtime_us_total counter\n");
+        }
+        for (int i = 0; i < task_count && err == ESP_OK; i++) {
+            snprintf(line, sizeof(line), "mimi_task_runtime_us_total{task=\"%s\",core=\"%d\"} %" PRIu32 "\n",
+                     tasks[i].name, tasks[i].core, tasks[i].runtime_us);
+            err = emit(ctx, line);
+        }
+        free(tasks);
+    }
+    return err;
+}
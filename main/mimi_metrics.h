@@ -0,0 +1,56 @@
+#ifndef MIMI_METRICS_H
+#define MIMI_METRICS_H
+
+#include <stdint.h>
+
+#include "esp_err.h"
+
+#define METRICS_WINDOW_SIZE 256 // Latest samples per stage the percentiles are computed from
+
+typedef enum {
+    METRIC_STAGE_CAPTURE_WAIT, // Blocked in esp_camera_fb_get()
+    METRIC_STAGE_PRE_ENCODE,   // esp_camera_fb_get() return to encode start (pool, input copy)
+    METRIC_STAGE_ENCODE,       // Encode start to encode end
+    METRIC_STAGE_PUBLISH,      // Encode end to the frame being handed to subscribers
+    METRIC_STAGE_QUEUE,        // Publish to dequeue by a stream client
+    METRIC_STAGE_SEND,         // Dequeue to the last byte given to the socket
+    METRIC_STAGE_TOTAL,        // esp_camera_fb_get() return to the last byte given to the socket
+    METRIC_STAGE_WS_RTT,       // Last byte given to the socket to the WebSocket client's ack
+    METRIC_STAGE_CONVERT,      // YCbYCr to YCbY2YCrY2 conversion, part of pre_encode
+    METRIC_STAGE_QUEUE_AGE_LATEST,      // Publish to dequeue, per frame bus policy (see mimi_frame_bus.h)
+    METRIC_STAGE_QUEUE_AGE_DROP_NEWEST,
+    METRIC_STAGE_QUEUE_AGE_BLOCK,
+    METRIC_STAGE_PUBLISH_BLOCKED,       // Encoder waiting for room in a blocking subscriber's queue
+    METRIC_STAGE_COUNT
+} metric_stage_t;
+
+typedef enum {
+    METRIC_COUNTER_FRAMES_PUBLISHED,
+    METRIC_COUNTER_FRAMES_SENT,
+    METRIC_COUNTER_CAPTURE_FAILED,
+    METRIC_COUNTER_ENCODE_FAILED,
+    METRIC_COUNTER_DROPPED_QUEUE_FULL, // Subscriber queue full, the frame is skipped for that subscriber
+    METRIC_COUNTER_DROPPED_WS_WINDOW,  // WebSocket client has its window of unacknowledged frames full
+    METRIC_COUNTER_RTP_FRAMES_SENT,
+    METRIC_COUNTER_RTP_DROPPED_LATE,   // Too old when the RTP sender got to it, or the UDP send failed mid-frame
+    METRIC_COUNTER_SKIPPED_STATIC,     // Not encoded, the scene hadn't changed (see mimi_motion.h)
+    METRIC_COUNTER_REPLACED_LATEST,    // Latest-wins subscriber: a waiting frame replaced by a newer one
+    METRIC_COUNTER_PUBLISH_BLOCKED,    // Blocking subscriber: the encoder had to wait for room
+    METRIC_COUNTER_DROPPED_BLOCK_TIMEOUT, // Blocking subscriber took nothing for FRAME_BUS_BLOCK_TIMEOUT_MS
+    METRIC_COUNTER_COUNT
+} metric_counter_t;
+
+/**
+ * Receives the text of the metrics page piece by piece.
+ */
+typedef esp_err_t (*metrics_emit_fn)(void *ctx, const char *text);
+
+void metrics_record(metric_stage_t stage, int64_t duration_us);
+void metrics_count(metric_counter_t counter);
+
+/**
+ * Writes p50/p95/p99 of every stage, the counters and the pipeline state in the Prometheus text format.
+ */
+esp_err_t metrics_write_prometheus(metrics_emit_fn emit, void *ctx);
+
+#endif //MIMI_METRICS_H
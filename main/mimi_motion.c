@@ -0,0 +1,127 @@
+#include "mimi_motion.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "esp_timer.h"
+#include "freertos/FreeRTOS.h"
+
+#define MOTION_ROW_STEP 2 // Every other row of a block is sampled
+#define MOTION_MAX_BLOCKS_X (480 / MOTION_BLOCK_SIZE)
+
+static volatile bool enabled = MOTION_DETECTION_ENABLED;
+static volatile uint8_t threshold = MOTION_DEFAULT_THRESHOLD;
+
+// Block means of the last frame let through, and of the current one
+static uint8_t reference[MOTION_MAX_BLOCKS];
+static uint8_t current[MOTION_MAX_BLOCKS];
+static uint16_t reference_width; // 0: no reference yet
+static uint16_t reference_height;
+static int64_t last_pass_time;
+
+static portMUX_TYPE motion_mux = portMUX_INITIALIZER_UNLOCKED;
+static uint32_t checked_count;
+static uint32_t skipped_count;
+static uint8_t last_changed;
+static uint64_t check_us_total;
+
+/**
+ * Mean luma of every block. A YCbYCr word (Y0 Cb Y1 Cr) is masked down to its two luma bytes, which are summed
+ * in two 16-bit lanes of one register (SWAR): one add per two pixels, and the chroma bytes are never unpacked.
+ * A lane sums at most 64 samples per block, so it can't overflow into the other.
+ */
+static void compute_block_means(const uint8_t *buf, const int width, const int height, uint8_t *means) {
+    const int blocks_x = width / MOTION_BLOCK_SIZE;
+    const int blocks_y = height / MOTION_BLOCK_SIZE;
+    const int words_per_row = width / 2;
+    const int words_per_block = MOTION_BLOCK_SIZE / 2;
+    const uint32_t *words = (const uint32_t *) buf;
+    uint32_t lanes[MOTION_MAX_BLOCKS_X];
+
+    for (int by = 0; by < blocks_y; by++) {
+        memset(lanes, 0, sizeof(lanes));
+        // Row by row across the whole block row: the buffer is read sequentially
+        for (int y = by * MOTION_BLOCK_SIZE; y < (by + 1) * MOTION_BLOCK_SIZE; y += MOTION_ROW_STEP) {
+            const uint32_t *row = words + y * words_per_row;
+            for (int bx = 0; bx < blocks_x; bx++) {
+                const uint32_t *block_row = row + bx * words_per_block;
+                uint32_t sum = 0;
+                for (int x = 0; x < words_per_block; x++) {
+                    sum += block_row[x] & 0x00FF00FF;
+                }
+                lanes[bx] += sum;
+            }
+        }
+        for (int bx = 0; bx < blocks_x; bx++) {
+            const uint32_t sum = (lanes[bx] & 0xFFFF) + (lanes[bx] >> 16);
+            means[by * blocks_x + bx] = sum / (MOTION_BLOCK_SIZE * MOTION_BLOCK_SIZE / MOTION_ROW_STEP);
+        }
+    }
+}
+
+bool motion_frame_changed(const camera_fb_t *fb, const int64_t capture_time) {
+    if (!enabled) {
+        reference_width = 0; // Start over when enabled again
+        return true;
+    }
+    const int blocks = (int) (fb->width / MOTION_BLOCK_SIZE) * (int) (fb->height / MOTION_BLOCK_SIZE);
+    if (((uintptr_t) fb->buf & 3) != 0 || fb->width % MOTION_BLOCK_SIZE != 0 || fb->height % MOTION_BLOCK_SIZE != 0 ||
+        fb->width / MOTION_BLOCK_SIZE > MOTION_MAX_BLOCKS_X || blocks > MOTION_MAX_BLOCKS) {
+        return true;
+    }
+
+    const int64_t start_time = esp_timer_get_time();
+    compute_block_means(fb->buf, (int) fb->width, (int) fb->height, current);
+
+    uint8_t changed = 100;
+    bool above_threshold = true; // No reference to compare with
+    if (reference_width == fb->width && reference_height == fb->height) {
+        int changed_blocks = 0;
+        for (int i = 0; i < blocks; i++) {
+            if (abs(current[i] - reference[i]) > MOTION_BLOCK_DELTA) {
+                changed_blocks++;
+            }
+        }
+        changed = changed_blocks * 100 / blocks;
+        // Compared in blocks, not the rounded-down %: with threshold 0 a single changed block is enough
+        above_threshold = changed_blocks * 100 > threshold * blocks;
+    }
+    // Keepalive frames also move the reference along with slow changes (light, drift)
+    const bool pass = above_threshold || capture_time - last_pass_time >= MOTION_KEEPALIVE_MS * 1000LL;
+    if (pass) {
+        memcpy(reference, current, blocks);
+        reference_width = fb->width;
+        reference_height = fb->height;
+        last_pass_time = capture_time;
+    }
+    const int64_t check_us = esp_timer_get_time() - start_time;
+
+    portENTER_CRITICAL(&motion_mux);
+    checked_count++;
+    if (!pass) {
+        skipped_count++;
+    }
+    last_changed = changed;
+    check_us_total += check_us;
+    portEXIT_CRITICAL(&motion_mux);
+    return pass;
+}
+
+void motion_set_enabled(const bool enable) {
+    enabled = enable;
+}
+
+void motion_set_threshold(const uint8_t percent) {
+    threshold = percent;
+}
+
+void motion_get_stats(motion_stats_t *stats) {
+    portENTER_CRITICAL(&motion_mux);
+    stats->enabled = enabled;
+    stats->threshold = threshold;
+    stats->checked = checked_count;
+    stats->skipped = skipped_count;
+    stats->last_changed = last_changed;
+    stats->avg_check_us = checked_count > 0 ? (uint32_t) (check_us_total / checked_count) : 0;
+    portEXIT_CRITICAL(&motion_mux);
+}
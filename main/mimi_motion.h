@@ -0,0 +1,36 @@
+#ifndef MIMI_MOTION_H
+#define MIMI_MOTION_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "esp_camera.h"
+
+#define MOTION_DETECTION_ENABLED 0     // Initial state, see motion_set_enabled()
+#define MOTION_DEFAULT_THRESHOLD 2     // A frame is encoded if more than this % of blocks changed
+#define MOTION_BLOCK_SIZE 16           // Pixels, luma is compared per block mean
+#define MOTION_BLOCK_DELTA 10          // Block mean change that counts, above the sensor noise
+#define MOTION_KEEPALIVE_MS 1000       // A static scene still gets a frame this often
+#define MOTION_MAX_BLOCKS (480 / MOTION_BLOCK_SIZE * 320 / MOTION_BLOCK_SIZE) // Largest video mode
+
+typedef struct {
+    bool enabled;
+    uint8_t threshold;                 // %
+    uint32_t checked;
+    uint32_t skipped;
+    uint8_t last_changed;              // % of blocks changed in the latest checked frame
+    uint32_t avg_check_us;
+} motion_stats_t;
+
+/**
+ * Change detection before encoding: compares the luma block means of a YCbYCr camera frame with those of the last
+ * frame that was let through. Returns false if the scene is static and the frame can be skipped (not more often
+ * than MOTION_KEEPALIVE_MS allows). Always true while disabled. Called by the camera task only.
+ */
+bool motion_frame_changed(const camera_fb_t *fb, int64_t capture_time);
+
+void motion_set_threshold(uint8_t percent);
+void motion_set_enabled(bool enable);
+void motion_get_stats(motion_stats_t *stats);
+
+#endif //MIMI_MOTION_H
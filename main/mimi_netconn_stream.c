@@ -0,0 +1,277 @@
+#include "mimi_netconn_stream.h"
+
+#include <stdio.h>
+#include <string.h>
+
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "lwip/api.h"
+#include "lwip/priv/tcpip_priv.h"
+#include "lwip/tcp.h"
+#include "mimi_common.h"
+#include "mimi_frame_bus.h"
+#include "mimi_metrics.h"
+#include "mimi_rate_control.h"
+#include "mimi_sched.h"
+#include "mimi_stream_sender.h"
+
+#define NETCONN_STREAM_TASK_STACK_SIZE 4096
+#define NETCONN_STREAM_REQUEST_TIMEOUT_MS 2000
+#define NETCONN_STREAM_IDLE_TIMEOUT_MS 1000
+
+static const char *response_header =
+    "HTTP/1.1 200 OK\r\n"
+    "Content-Type: multipart/x-mixed-replace; boundary=" STREAM_BOUNDARY "\r\n"
+    "Cache-Control: no-cache\r\n"
+    "Connection: close\r\n"
+    "\r\n";
+
+static const char *busy_response =
+    "HTTP/1.1 503 Service Unavailable\r\n"
+    "Content-Type: text/plain\r\n"
+    "Content-Length: 16\r\n"
+    "Connection: close\r\n"
+    "\r\n"
+    "Too many viewers";
+
+typedef struct {
+    jpeg_frame_t *frame;
+    uint32_t end;              // Stream offset just past the frame's last byte
+} in_flight_frame_t;
+
+typedef struct {
+    struct netconn *conn;
+    uint32_t written;          // Bytes handed to lwIP since the connection was accepted
+    in_flight_frame_t in_flight[NETCONN_STREAM_IN_FLIGHT]; // Oldest first
+    int in_flight_count;
+} netconn_client_t;
+
+typedef struct {
+    struct tcpip_api_call_data call;
+    struct netconn *conn;
+    bool abort;
+    uint32_t unacked;
+} tcp_query_t;
+
+static TaskHandle_t stream_task_handle;
+
+/**
+ * lwIP thread: acks that free send buffer space signal NETCONN_EVT_SENDPLUS, which ends the wait for acks.
+ */
+static void netconn_event(struct netconn *, const enum netconn_evt event, u16_t) {
+    if (event == NETCONN_EVT_SENDPLUS && stream_task_handle != NULL) {
+        xTaskNotifyGive(stream_task_handle);
+    }
+}
+
+/**
+ * Waits for the next acks. One tick at most: not every ack signals NETCONN_EVT_SENDPLUS.
+ */
+static void wait_for_acks(void) {
+    ulTaskNotifyTake(pdTRUE, 1);
+}
+
+/**
+ * Runs in the lwIP thread, the only one that may touch the pcb.
+ */
+static err_t query_tcp(struct tcpip_api_call_data *call) {
+    tcp_query_t *query = (tcp_query_t *) call;
+    struct tcp_pcb *pcb = query->conn->pcb.tcp;
+    // Without a pcb the connection was reset or aborted and lwIP has freed its segments
+    query->unacked = pcb != NULL ? pcb->snd_lbb - pcb->lastack : 0;
+    if (pcb != NULL && query->abort) {
+        tcp_abort(pcb); // The netconn learns about it through its error callback
+        query->unacked = 0;
+    }
+    return ERR_OK;
+}
+
+/**
+ * Returns frames to the pool whose bytes TCP has all acknowledged. `abort` resets the connection first, which
+ * drops everything lwIP still references.
+ */
+static void release_acked(netconn_client_t *client, const bool abort) {
+    tcp_query_t query = {.conn = client->conn, .abort = abort};
+    tcpip_api_call(query_tcp, &query.call);
+    const uint32_t acked = client->written - query.unacked;
+
+    int released = 0;
+    while (released < client->in_flight_count && (int32_t) (acked - client->in_flight[released].end) >= 0) {
+        jpeg_frame_release(client->in_flight[released].frame);
+        released++;
+    }
+    if (released > 0) {
+        client->in_flight_count -= released;
+        memmove(client->in_flight, client->in_flight + released, client->in_flight_count * sizeof(in_flight_frame_t));
+    }
+}
+
+static void close_client(netconn_client_t *client) {
+    const int64_t deadline = esp_timer_get_time() + NETCONN_STREAM_CLOSE_TIMEOUT_MS * 1000LL;
+    release_acked(client, false);
+    while (client->in_flight_count > 0 && esp_timer_get_time() < deadline) {
+        wait_for_acks();
+        release_acked(client, false);
+    }
+    if (client->in_flight_count > 0) {
+        release_acked(client, true);
+    }
+    netconn_close(client->conn);
+    netconn_delete(client->conn);
+}
+
+/**
+ * Queues the part header (copied, held back to share a segment) and the JPEG by reference. Only the bytes lwIP
+ * accepted count as written. After an error lwIP may still reference part of the frame, and of the ones before it,
+ * for retransmission: the connection is reset before any of them goes back to the pool.
+ */
+static bool send_frame(netconn_client_t *client, jpeg_frame_t *frame) {
+    char header[96];
+    const int header_len = snprintf(header, sizeof(header),
+                                    "\r\n--" STREAM_BOUNDARY "\r\nContent-Type: image/jpeg\r\nContent-Length: %u\r\n\r\n",
+                                    frame->fb.len);
+    const int64_t start_time = esp_timer_get_time();
+    metrics_record(METRIC_STAGE_QUEUE, start_time - frame->publish_time);
+    size_t header_written = 0;
+    err_t err = netconn_write_partly(client->conn, header, header_len, NETCONN_COPY | NETCONN_MORE, &header_written);
+    client->written += header_written;
+    if (err == ERR_OK) {
+        size_t frame_written = 0;
+        err = netconn_write_partly(client->conn, frame->fb.buf, frame->fb.len, NETCONN_NOCOPY, &frame_written);
+        client->written += frame_written;
+    }
+    client->in_flight[client->in_flight_count++] = (in_flight_frame_t){.frame = frame, .end = client->written};
+    if (err != ERR_OK) {
+        ESP_LOGI(TAG_MIMI, "Netconn stream client gone (%d)", err);
+        release_acked(client, true);
+        return false;
+    }
+
+    const int64_t sent_time = esp_timer_get_time();
+    metrics_record(METRIC_STAGE_SEND, sent_time - start_time);
+    metrics_record(METRIC_STAGE_TOTAL, sent_time - frame->capture_time);
+    metrics_count(METRIC_COUNTER_FRAMES_SENT);
+    rate_control_on_frame_sent((int) frame->fb.len, sent_time - start_time);
+    return true;
+}
+
+/**
+ * Takes the next complete frame from the subscriber queue, waiting for frame bus notifications.
+ */
+static jpeg_frame_t *next_frame(frame_subscriber_t *subscriber) {
+    jpeg_frame_t *frame;
+    while (!frame_bus_receive(subscriber, &frame, 0)) {
+        ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(NETCONN_STREAM_IDLE_TIMEOUT_MS));
+    }
+    while (!jpeg_frame_is_complete(frame)) { // Low-latency mode: published while still being encoded
+        ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(NETCONN_STREAM_IDLE_TIMEOUT_MS));
+    }
+    if (frame->fb.len == 0) { // Failed to encode
+        jpeg_frame_release(frame);
+        return NULL;
+    }
+    return frame;
+}
+
+/**
+ * Picks ?policy=latest|drop-newest|block out of the request line, FRAME_BUS_DEFAULT_POLICY otherwise.
+ */
+static frame_bus_policy_t request_policy(struct netbuf *request) {
+    frame_bus_policy_t policy = FRAME_BUS_DEFAULT_POLICY;
+    void *data;
+    u16_t len;
+    if (netbuf_data(request, &data, &len) != ERR_OK) {
+        return policy;
+    }
+    char line[96];
+    const size_t n = len < sizeof(line) - 1 ? len : sizeof(line) - 1;
+    memcpy(line, data, n);
+    line[n] = '\0';
+    line[strcspn(line, "\r\n")] = '\0';
+
+    const char *value = strstr(line, "?policy=");
+    value = value != NULL ? value : strstr(line, "&policy=");
+    if (value != NULL) {
+        value += strlen("?policy=");
+        char name[16];
+        snprintf(name, sizeof(name), "%.*s", (int) strcspn(value, "& "), value);
+        frame_bus_parse_policy(name, &policy);
+    }
+    return policy;
+}
+
+static void serve_client(struct netconn *conn) {
+    netconn_client_t client = {.conn = conn};
+    // Any request path gets the stream, it only has to arrive
+    netconn_set_recvtimeout(conn, NETCONN_STREAM_REQUEST_TIMEOUT_MS);
+    struct netbuf *request;
+    if (netconn_recv(conn, &request) != ERR_OK) {
+        close_client(&client);
+        return;
+    }
+    const frame_bus_policy_t policy = request_policy(request);
+    netbuf_delete(request);
+
+    frame_subscriber_t *subscriber = frame_bus_subscribe();
+    if (subscriber == NULL) {
+        size_t written = 0;
+        netconn_write_partly(conn, busy_response, strlen(busy_response), NETCONN_NOCOPY, &written);
+        client.written += written;
+        close_client(&client);
+        return;
+    }
+    frame_bus_set_policy(subscriber, policy);
+    netconn_set_sendtimeout(conn, NETCONN_STREAM_SEND_TIMEOUT_MS);
+    ESP_LOGI(TAG_MIMI, "Netconn stream client connected (policy %s)", frame_bus_policy_name(policy));
+
+    size_t header_written = 0;
+    bool connected = netconn_write_partly(conn, response_header, strlen(response_header), NETCONN_NOCOPY,
+                                          &header_written) == ERR_OK;
+    client.written += header_written;
+    while (connected) {
+        jpeg_frame_t *frame = next_frame(subscriber);
+        if (frame == NULL) {
+            continue;
+        }
+        release_acked(&client, false);
+        while (client.in_flight_count == NETCONN_STREAM_IN_FLIGHT) {
+            wait_for_acks();
+            release_acked(&client, false);
+        }
+        connected = send_frame(&client, frame);
+    }
+
+    frame_bus_unsubscribe(subscriber);
+    close_client(&client);
+}
+
+static void netconn_stream_task(void *) {
+    // Accepted connections inherit the callback
+    struct netconn *listener = netconn_new_with_callback(NETCONN_TCP, netconn_event);
+    if (listener == NULL || netconn_bind(listener, IP_ADDR_ANY, NETCONN_STREAM_PORT) != ERR_OK ||
+        netconn_listen(listener) != ERR_OK) {
+        ESP_LOGE(TAG_MIMI, "Netconn stream: failed to listen on port %d", NETCONN_STREAM_PORT);
+        vTaskDelete(NULL);
+        return;
+    }
+    ESP_LOGI(TAG_MIMI, "Netconn stream listening on port %d", NETCONN_STREAM_PORT);
+    sched_register_task(xTaskGetCurrentTaskHandle(), SCHED_ROLE_STREAMING);
+
+    // ReSharper disable once CppDFAEndlessLoop
+    while (true) {
+        struct netconn *conn;
+        if (netconn_accept(listener, &conn) == ERR_OK) {
+            serve_client(conn);
+        }
+    }
+}
+
+esp_err_t netconn_stream_start(void) {
+    if (xTaskCreatePinnedToCore(netconn_stream_task, "netconn_stream", NETCONN_STREAM_TASK_STACK_SIZE, NULL,
+                                sched_priority(SCHED_ROLE_STREAMING), &stream_task_handle,
+                                sched_core(SCHED_ROLE_STREAMING)) != pdPASS) {
+        ESP_LOGE(TAG_MIMI, "Failed to create netconn stream task");
+        return ESP_FAIL;
+    }
+    return ESP_OK;
+}
@@ -0,0 +1,20 @@
+#ifndef MIMI_NETCONN_STREAM_H
+#define MIMI_NETCONN_STREAM_H
+
+#include "esp_err.h"
+
+#define NETCONN_STREAM_ENABLED 1
+#define NETCONN_STREAM_PORT 81
+#define NETCONN_STREAM_IN_FLIGHT 2          // Frames lwIP may reference at once, until the client acknowledges them
+#define NETCONN_STREAM_SEND_TIMEOUT_MS 5000 // A client that takes nothing for this long is dropped
+#define NETCONN_STREAM_CLOSE_TIMEOUT_MS 1000 // Waiting for the last acks before the connection is reset
+
+/**
+ * MJPEG stream on its own port (http://<host>:81/), sent with lwIP's netconn API without copying: the JPEG in
+ * PSRAM is queued by reference (NETCONN_NOCOPY) and each frame goes back to the pool only once TCP has the whole
+ * frame acknowledged. Complete frames only (no low-latency stripes), one viewer at a time; further connections wait
+ * in the listen backlog. /stream stays the general-purpose path.
+ */
+esp_err_t netconn_stream_start(void);
+
+#endif //MIMI_NETCONN_STREAM_H
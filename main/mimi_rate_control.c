@@ -0,0 +1,100 @@
+#include "mimi_rate_control.h"
+
+#include "esp_timer.h"
+#include "freertos/FreeRTOS.h"
+
+#define EWMA_WEIGHT 0.125f
+#define THROUGHPUT_HEADROOM 0.8f        // Keep the budget below the measured throughput
+#define QUALITY_UP_THRESHOLD 0.7f       // Raise the quality only if frames are well below the budget
+#define SEND_SAMPLE_TIMEOUT_US 2000000  // Without recent send samples there is nobody to adapt to
+#define MIN_SEND_SAMPLE_US 200          // Sends faster than this only filled the socket buffer
+
+static portMUX_TYPE rate_control_mux = portMUX_INITIALIZER_UNLOCKED;
+
+static uint8_t quality = RATE_CONTROL_INITIAL_QUALITY;
+static float frame_bytes = 0;
+static float throughput_bytes_per_s = 0;
+static int64_t last_send_time = 0;
+static uint32_t budget_bytes = 0;
+static float link_bytes_per_s = 0;
+
+static float ewma(const float average, const float sample) {
+    return average == 0 ? sample : average + EWMA_WEIGHT * (sample - average);
+}
+
+void rate_control_on_frame_encoded(const int jpeg_len) {
+    portENTER_CRITICAL(&rate_control_mux);
+    frame_bytes = ewma(frame_bytes, (float)jpeg_len);
+    portEXIT_CRITICAL(&rate_control_mux);
+}
+
+void rate_control_on_frame_sent(const int bytes, const int64_t send_us) {
+    if (send_us < MIN_SEND_SAMPLE_US) {
+        return;
+    }
+    const float sample = (float)bytes * 1000000.0f / (float)send_us;
+    portENTER_CRITICAL(&rate_control_mux);
+    throughput_bytes_per_s = ewma(throughput_bytes_per_s, sample);
+    last_send_time = esp_timer_get_time();
+    portEXIT_CRITICAL(&rate_control_mux);
+}
+
+void rate_control_on_link_sample(const int8_t rssi, const uint32_t phy_rate_kbps) {
+    float usable = (float)(rssi - RATE_CONTROL_LINK_RSSI_POOR) / (RATE_CONTROL_LINK_RSSI_GOOD - RATE_CONTROL_LINK_RSSI_POOR);
+    usable = usable > 1 ? 1 : usable < 0 ? 0 : usable;
+    const float bytes_per_s = phy_rate_kbps * 1000.0f / 8 * RATE_CONTROL_LINK_EFFICIENCY * (0.1f + 0.9f * usable);
+    portENTER_CRITICAL(&rate_control_mux);
+    link_bytes_per_s = bytes_per_s;
+    portEXIT_CRITICAL(&rate_control_mux);
+}
+
+uint8_t rate_control_next_quality(const uint32_t queued_frames) {
+#if RATE_CONTROL_ENABLED
+    portENTER_CRITICAL(&rate_control_mux);
+    const bool measured = last_send_time != 0 && esp_timer_get_time() - last_send_time < SEND_SAMPLE_TIMEOUT_US;
+    float budget = throughput_bytes_per_s * THROUGHPUT_HEADROOM / RATE_CONTROL_TARGET_FPS;
+    const float link_budget = link_bytes_per_s / RATE_CONTROL_TARGET_FPS;
+    if (link_budget > 0 && link_budget < budget) {
+        budget = link_budget;
+    }
+#if RATE_CONTROL_MAX_BITRATE_KBPS > 0
+    const float bitrate_budget = RATE_CONTROL_MAX_BITRATE_KBPS * 1000.0f / 8 / RATE_CONTROL_TARGET_FPS;
+    if (budget == 0 || bitrate_budget < budget) {
+        budget = bitrate_budget;
+    }
+#endif
+    budget_bytes = (uint32_t)budget;
+
+    if (measured && budget > 0) {
+        if (queued_frames > 0 || frame_bytes > budget) {
+            // Back off quickly: a congested link turns into seconds of lag
+            const int step = quality / 8 > 1 ? quality / 8 : 1;
+            quality = quality - step > RATE_CONTROL_MIN_QUALITY ? quality - step : RATE_CONTROL_MIN_QUALITY;
+        } else if (frame_bytes < budget * QUALITY_UP_THRESHOLD && quality < RATE_CONTROL_MAX_QUALITY) {
+            quality++;
+        }
+    }
+    const uint8_t result = quality;
+    portEXIT_CRITICAL(&rate_control_mux);
+    return result;
+#else
+    return RATE_CONTROL_INITIAL_QUALITY;
+#endif
+}
+
+void rate_control_get_state(rate_control_state_t *state) {
+    portENTER_CRITICAL(&rate_control_mux);
+    state->quality = quality;
+    state->frame_bytes = (uint32_t)frame_bytes;
+    state->throughput_kbps = (uint32_t)(throughput_bytes_per_s * 8 / 1000);
+    state->budget_bytes = budget_bytes;
+    state->link_kbps = (uint32_t)(link_bytes_per_s * 8 / 1000);
+    portEXIT_CRITICAL(&rate_control_mux);
+}
+
+void rate_control_reset(void) {
+    portENTER_CRITICAL(&rate_control_mux);
+    quality = RATE_CONTROL_INITIAL_QUALITY;
+    frame_bytes = 0;
+    portEXIT_CRITICAL(&rate_control_mux);
+}
@@ -0,0 +1,57 @@
+#ifndef MIMI_RATE_CONTROL_H
+#define MIMI_RATE_CONTROL_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// 0: JPEG quality stays at RATE_CONTROL_INITIAL_QUALITY
+#define RATE_CONTROL_ENABLED 1
+#define RATE_CONTROL_INITIAL_QUALITY 10
+#define RATE_CONTROL_MIN_QUALITY 5
+#define RATE_CONTROL_MAX_QUALITY 80
+#define RATE_CONTROL_TARGET_FPS 25
+#define RATE_CONTROL_MAX_BITRATE_KBPS 0 // 0: limited by the measured throughput only
+#define RATE_CONTROL_LINK_EFFICIENCY 0.5f // Share of the PHY rate left for payload after MAC overhead and retries
+#define RATE_CONTROL_LINK_RSSI_GOOD -60   // dBm from which the full PHY rate is assumed
+#define RATE_CONTROL_LINK_RSSI_POOR -85   // dBm at which a tenth of it is left
+
+typedef struct {
+    uint8_t quality;
+    uint32_t frame_bytes;      // Smoothed JPEG size
+    uint32_t throughput_kbps;  // Smoothed rate at which clients accept data, 0 until measured
+    uint32_t budget_bytes;     // Frame size that fits the throughput at the target fps
+    uint32_t link_kbps;        // Estimated from Wi-Fi RSSI and PHY rate, 0 while disconnected
+} rate_control_state_t;
+
+/**
+ * Closed-loop JPEG quality controller. It watches encoded frame sizes, how long clients take to send them and
+ * how many frames wait in subscriber queues, and moves the quality towards the largest frames that still go
+ * through at RATE_CONTROL_TARGET_FPS.
+ */
+void rate_control_on_frame_encoded(int jpeg_len);
+
+/**
+ * Called by stream senders after a frame was written to a client.
+ */
+void rate_control_on_frame_sent(int bytes, int64_t send_us);
+
+/**
+ * Called by the Wi-Fi module with the smoothed RSSI and nominal PHY rate, (0, 0) while disconnected. The link
+ * estimate caps the budget before a weakening signal shows up in send times.
+ */
+void rate_control_on_link_sample(int8_t rssi, uint32_t phy_rate_kbps);
+
+/**
+ * Returns the quality for the next frame. `queued_frames` is the deepest subscriber queue right now.
+ */
+uint8_t rate_control_next_quality(uint32_t queued_frames);
+
+void rate_control_get_state(rate_control_state_t *state);
+
+/**
+ * Forgets the frame size history and starts over from RATE_CONTROL_INITIAL_QUALITY, e.g. after a resolution
+ * change. The measured throughput is a property of the link and is kept.
+ */
+void rate_control_reset(void);
+
+#endif //MIMI_RATE_CONTROL_H
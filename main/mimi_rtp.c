@@ -0,0 +1,386 @@
+#include "mimi_rtp.h"
+
+#include <string.h>
+
+#include "esp_log.h"
+#include "esp_random.h"
+#include "esp_timer.h"
+#include "mimi_common.h"
+#include "mimi_frame_bus.h"
+#include "mimi_metrics.h"
+#include "mimi_sched.h"
+#include "freertos/queue.h"
+
+#define RTP_TASK_STACK_SIZE 4096
+#define RTP_PAYLOAD_TYPE_JPEG 26
+#define RTP_HEADER_SIZE 12
+#define RTP_JPEG_HEADER_SIZE 8
+#define RTP_RESTART_HEADER_SIZE 4
+#define RTP_QTABLE_HEADER_SIZE 4
+#define RTP_QTABLE_SIZE 64
+#define RTP_JPEG_Q_IN_BAND 255   // Quantization tables are sent in the first packet of every frame
+#define RTP_JPEG_TYPE_RESTART 64
+#define RTP_JPEG_MAX_DIMENSION 2040
+
+typedef enum {
+    JPEG_PARSE_INCOMPLETE,
+    JPEG_PARSE_OK,
+    JPEG_PARSE_UNSUPPORTED
+} jpeg_parse_result_t;
+
+/**
+ * What RFC 2435 needs from the JPEG headers, which are not sent themselves.
+ */
+typedef struct {
+    uint8_t type;              // 0: 4:2:2, 1: 4:2:0, +RTP_JPEG_TYPE_RESTART if restart markers are used
+    uint8_t width;             // In units of 8 pixels
+    uint8_t height;
+    uint16_t restart_interval;
+    const uint8_t *qtables[2]; // Luma and chroma, zigzag order as in the DQT segment
+    uint32_t scan_offset;      // First byte of the entropy-coded data
+} rtp_jpeg_info_t;
+
+typedef struct {
+    jpeg_frame_t *frame;       // NULL while waiting for the next one
+    rtp_jpeg_info_t info;
+    bool header_parsed;
+    uint32_t offset;           // Fragment offset: scan bytes sent so far
+    uint32_t timestamp;
+} rtp_frame_t;
+
+typedef struct {
+    bool start;
+    struct sockaddr_in dest;
+} rtp_session_request_t;
+
+static QueueHandle_t session_requests;
+static TaskHandle_t rtp_task_handle;
+static int rtp_socket = -1;
+static struct sockaddr_in destination;
+static frame_subscriber_t *subscriber;
+static uint16_t sequence;
+static uint32_t ssrc;
+static uint8_t packet[RTP_MAX_PACKET_SIZE];
+
+static void put_u16(uint8_t *p, const uint32_t value) {
+    p[0] = value >> 8;
+    p[1] = value;
+}
+
+static void put_u24(uint8_t *p, const uint32_t value) {
+    p[0] = value >> 16;
+    p[1] = value >> 8;
+    p[2] = value;
+}
+
+static void put_u32(uint8_t *p, const uint32_t value) {
+    p[0] = value >> 24;
+    p[1] = value >> 16;
+    p[2] = value >> 8;
+    p[3] = value;
+}
+
+/**
+ * Walks the marker segments up to SOS. Only baseline YUV 4:2:2 / 4:2:0 with 8-bit tables 0 (luma) and 1 (chroma)
+ * fits the RFC 2435 types, which is what the encoder produces.
+ */
+static jpeg_parse_result_t parse_jpeg_header(const uint8_t *buf, const uint32_t len, rtp_jpeg_info_t *info) {
+    memset(info, 0, sizeof(*info));
+    if (len < 2) {
+        return JPEG_PARSE_INCOMPLETE;
+    }
+    if (buf[0] != 0xFF || buf[1] != 0xD8) {
+        return JPEG_PARSE_UNSUPPORTED;
+    }
+    bool have_sof = false;
+    uint32_t pos = 2;
+    while (true) {
+        if (pos + 4 > len) {
+            return JPEG_PARSE_INCOMPLETE;
+        }
+        if (buf[pos] != 0xFF) {
+            return JPEG_PARSE_UNSUPPORTED;
+        }
+        const uint8_t marker = buf[pos + 1];
+        const uint32_t segment_len = (buf[pos + 2] << 8) | buf[pos + 3]; // Includes the length field
+        const uint8_t *segment = buf + pos + 4;
+        const uint32_t end = pos + 2 + segment_len;
+        if (segment_len < 2) {
+            return JPEG_PARSE_UNSUPPORTED;
+        }
+        if (end > len) {
+            return JPEG_PARSE_INCOMPLETE;
+        }
+
+        switch (marker) {
+            case 0xDB: // DQT
+                for (const uint8_t *table = segment; table + 1 + RTP_QTABLE_SIZE <= buf + end;
+                     table += 1 + RTP_QTABLE_SIZE) {
+                    if ((table[0] >> 4) != 0 || (table[0] & 0x0F) > 1) {
+                        return JPEG_PARSE_UNSUPPORTED; // 16-bit precision or more than two tables
+                    }
+                    info->qtables[table[0] & 0x0F] = table + 1;
+                }
+                break;
+            case 0xC0: { // SOF0
+                if (segment_len < 17 || segment[0] != 8 || segment[5] != 3) {
+                    return JPEG_PARSE_UNSUPPORTED;
+                }
+                const uint32_t height = (segment[1] << 8) | segment[2];
+                const uint32_t width = (segment[3] << 8) | segment[4];
+                if (width == 0 || height == 0 || width > RTP_JPEG_MAX_DIMENSION || height > RTP_JPEG_MAX_DIMENSION) {
+                    return JPEG_PARSE_UNSUPPORTED;
+                }
+                // Per component: id, sampling factors, quantization table
+                if (segment[8] != 0 || segment[10] != 0x11 || segment[11] != 1 || segment[13] != 0x11 ||
+                    segment[14] != 1) {
+                    return JPEG_PARSE_UNSUPPORTED;
+                }
+                if (segment[7] == 0x21) {
+                    info->type = 0;
+                } else if (segment[7] == 0x22) {
+                    info->type = 1;
+                } else {
+                    return JPEG_PARSE_UNSUPPORTED;
+                }
+                info->width = (width + 7) / 8;
+                info->height = (height + 7) / 8;
+                have_sof = true;
+                break;
+            }
+            case 0xDD: // DRI
+                info->restart_interval = (segment[0] << 8) | segment[1];
+                break;
+            case 0xDA: // SOS
+                if (!have_sof || info->qtables[0] == NULL || info->qtables[1] == NULL) {
+                    return JPEG_PARSE_UNSUPPORTED;
+                }
+                if (info->restart_interval != 0) {
+                    info->type += RTP_JPEG_TYPE_RESTART;
+                }
+                info->scan_offset = end;
+                return JPEG_PARSE_OK;
+            default: // APPn, DHT, COM; other SOFs never get here with have_sof set
+                break;
+        }
+        pos = end;
+    }
+}
+
+static uint32_t packet_overhead(const rtp_frame_t *current) {
+    uint32_t overhead = RTP_HEADER_SIZE + RTP_JPEG_HEADER_SIZE;
+    if (current->info.restart_interval != 0) {
+        overhead += RTP_RESTART_HEADER_SIZE;
+    }
+    if (current->offset == 0) {
+        overhead += RTP_QTABLE_HEADER_SIZE + 2 * RTP_QTABLE_SIZE;
+    }
+    return overhead;
+}
+
+static bool send_fragment(const rtp_frame_t *current, const uint8_t *data, const uint32_t len, const bool last) {
+    const rtp_jpeg_info_t *info = &current->info;
+    uint8_t *p = packet;
+
+    p[0] = 0x80; // Version 2
+    p[1] = (last ? 0x80 : 0x00) | RTP_PAYLOAD_TYPE_JPEG;
+    put_u16(p + 2, sequence++);
+    put_u32(p + 4, current->timestamp);
+    put_u32(p + 8, ssrc);
+    p += RTP_HEADER_SIZE;
+
+    p[0] = 0; // Type-specific
+    put_u24(p + 1, current->offset);
+    p[4] = info->type;
+    p[5] = RTP_JPEG_Q_IN_BAND;
+    p[6] = info->width;
+    p[7] = info->height;
+    p += RTP_JPEG_HEADER_SIZE;
+
+    if (info->restart_interval != 0) {
+        // Fragments are not aligned to restart intervals: F = L = 1, count 0x3FFF (reassemble the whole frame)
+        put_u16(p, info->restart_interval);
+        put_u16(p + 2, 0xFFFF);
+        p += RTP_RESTART_HEADER_SIZE;
+    }
+
+    if (current->offset == 0) {
+        p[0] = 0; // MBZ
+        p[1] = 0; // 8-bit precision for both tables
+        put_u16(p + 2, 2 * RTP_QTABLE_SIZE);
+        memcpy(p + RTP_QTABLE_HEADER_SIZE, info->qtables[0], RTP_QTABLE_SIZE);
+        memcpy(p + RTP_QTABLE_HEADER_SIZE + RTP_QTABLE_SIZE, info->qtables[1], RTP_QTABLE_SIZE);
+        p += RTP_QTABLE_HEADER_SIZE + 2 * RTP_QTABLE_SIZE;
+    }
+
+    memcpy(p, data, len);
+    p += len;
+    return sendto(rtp_socket, packet, p - packet, MSG_DONTWAIT,
+                  (const struct sockaddr *) &destination, sizeof(destination)) >= 0;
+}
+
+/**
+ * Packetizes what the encoder has produced so far: full packets while a low-latency frame is being encoded,
+ * the rest once it is complete. Returns true when the frame is done with (sent or dropped).
+ */
+static bool send_frame(rtp_frame_t *current) {
+    jpeg_frame_t *frame = current->frame;
+    const bool complete = jpeg_frame_is_complete(frame); // Before encoded_len: then it is final
+    uint32_t available = atomic_load(&frame->encoded_len);
+    if (complete && frame->fb.len == 0) {
+        return true; // Failed to encode, counted by the camera task
+    }
+
+    if (!current->header_parsed) {
+        const jpeg_parse_result_t result = parse_jpeg_header(frame->fb.buf, available, &current->info);
+        if (result == JPEG_PARSE_INCOMPLETE && !complete) {
+            return false;
+        }
+        if (result != JPEG_PARSE_OK) {
+            ESP_LOGW(TAG_MIMI, "RTP: unsupported JPEG layout, frame dropped");
+            return true;
+        }
+        current->header_parsed = true;
+    }
+
+    // The receiver appends EOI itself
+    if (complete && available >= current->info.scan_offset + 2 &&
+        frame->fb.buf[available - 2] == 0xFF && frame->fb.buf[available - 1] == 0xD9) {
+        available -= 2;
+    }
+
+    while (true) {
+        const uint32_t start = current->info.scan_offset + current->offset;
+        const uint32_t capacity = RTP_MAX_PACKET_SIZE - packet_overhead(current);
+        uint32_t len = available - start;
+        bool last = complete;
+        if (len > capacity) {
+            len = capacity;
+            last = false;
+        } else if (!complete) {
+            return false; // Woken up by the frame bus when the next stripe is encoded
+        }
+
+        if (!send_fragment(current, frame->fb.buf + start, len, last)) {
+            // Out of buffers: the rest of this frame would arrive late anyway
+            metrics_count(METRIC_COUNTER_RTP_DROPPED_LATE);
+            return true;
+        }
+        current->offset += len;
+        if (last) {
+            metrics_count(METRIC_COUNTER_RTP_FRAMES_SENT);
+            return true;
+        }
+    }
+}
+
+static void release_frame(rtp_frame_t *current) {
+    if (current->frame != NULL) {
+        jpeg_frame_release(current->frame);
+        current->frame = NULL;
+    }
+}
+
+static void stop_session(rtp_frame_t *current) {
+    release_frame(current);
+    if (subscriber != NULL) {
+        frame_bus_unsubscribe(subscriber);
+        subscriber = NULL;
+    }
+    if (rtp_socket >= 0) {
+        close(rtp_socket);
+        rtp_socket = -1;
+    }
+}
+
+static void handle_session_requests(rtp_frame_t *current) {
+    rtp_session_request_t request;
+    while (xQueueReceive(session_requests, &request, 0) == pdTRUE) {
+        if (!request.start) {
+            if (subscriber != NULL) {
+                ESP_LOGI(TAG_MIMI, "RTP session stopped");
+            }
+            stop_session(current);
+            continue;
+        }
+
+        if (rtp_socket < 0) {
+            rtp_socket = socket(AF_INET, SOCK_DGRAM, IPPROTO_IP);
+            if (rtp_socket < 0) {
+                ESP_LOGE(TAG_MIMI, "RTP: failed to create socket (errno %d)", errno);
+                continue;
+            }
+        }
+        if (subscriber == NULL) {
+            subscriber = frame_bus_subscribe();
+            if (subscriber == NULL) {
+                ESP_LOGE(TAG_MIMI, "RTP: no free frame bus slot");
+                stop_session(current);
+                continue;
+            }
+            ssrc = esp_random();
+            sequence = esp_random();
+        }
+        destination = request.dest;
+        char addr[16];
+        inet_ntoa_r(destination.sin_addr, addr, sizeof(addr));
+        ESP_LOGI(TAG_MIMI, "RTP session started to %s:%u", addr, ntohs(destination.sin_port));
+    }
+}
+
+static void rtp_task(void *) {
+    rtp_frame_t current = {0};
+    // ReSharper disable once CppDFAEndlessLoop
+    while (true) {
+        handle_session_requests(&current);
+
+        while (subscriber != NULL) {
+            if (current.frame == NULL) {
+                jpeg_frame_t *frame;
+                if (!frame_bus_receive(subscriber, &frame, 0)) {
+                    break;
+                }
+                if (esp_timer_get_time() - frame->capture_time > RTP_MAX_FRAME_AGE_MS * 1000) {
+                    metrics_count(METRIC_COUNTER_RTP_DROPPED_LATE);
+                    jpeg_frame_release(frame);
+                    continue;
+                }
+                current = (rtp_frame_t){
+                    .frame = frame,
+                    .timestamp = (uint32_t) (frame->capture_time * 9 / 100), // 90 kHz clock
+                };
+            }
+            if (!send_frame(&current)) {
+                break;
+            }
+            release_frame(&current);
+        }
+
+        // Frame bus notifications and session requests
+        ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+    }
+}
+
+esp_err_t rtp_start(void) {
+    session_requests = xQueueCreate(2, sizeof(rtp_session_request_t));
+    if (xTaskCreatePinnedToCore(rtp_task, "rtp_sender", RTP_TASK_STACK_SIZE, NULL,
+                                sched_priority(SCHED_ROLE_STREAMING), &rtp_task_handle,
+                                sched_core(SCHED_ROLE_STREAMING)) != pdPASS) {
+        ESP_LOGE(TAG_MIMI, "Failed to create RTP task");
+        return ESP_FAIL;
+    }
+    sched_register_task(rtp_task_handle, SCHED_ROLE_STREAMING);
+    return ESP_OK;
+}
+
+esp_err_t rtp_set_destination(const struct sockaddr_in *dest) {
+    rtp_session_request_t request = {.start = dest != NULL};
+    if (dest != NULL) {
+        request.dest = *dest;
+    }
+    if (xQueueSend(session_requests, &request, 0) != pdTRUE) {
+        return ESP_ERR_NO_MEM;
+    }
+    xTaskNotifyGive(rtp_task_handle);
+    return ESP_OK;
+}
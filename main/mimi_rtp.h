@@ -0,0 +1,25 @@
+#ifndef MIMI_RTP_H
+#define MIMI_RTP_H
+
+#include <stdint.h>
+
+#include "esp_err.h"
+#include "lwip/sockets.h"
+
+#define RTP_DEFAULT_PORT 5004
+#define RTP_MAX_PACKET_SIZE 1400     // Stays below the Wi-Fi MTU, no IP fragmentation
+#define RTP_MAX_FRAME_AGE_MS 100     // Older frames are dropped instead of sent late
+
+/**
+ * RTP/JPEG (RFC 2435) over UDP, an alternative to /stream for lossy links: a lost packet costs one frame instead
+ * of stalling the stream until TCP retransmits. Frames come from the frame bus, like /stream.
+ * One session at a time, started and stopped over HTTP (/rtp).
+ */
+esp_err_t rtp_start(void);
+
+/**
+ * Starts sending to `dest` (replaces the current destination), stops if `dest` is NULL.
+ */
+esp_err_t rtp_set_destination(const struct sockaddr_in *dest);
+
+#endif //MIMI_RTP_H
@@ -0,0 +1,180 @@
+#include "mimi_sched.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "esp_log.h"
+#include "mimi_common.h"
+#include "nvs.h"
+#include "sdkconfig.h"
+
+#define SCHED_NVS_NAMESPACE "mimi"
+#define SCHED_NVS_KEY "sched_profile"
+
+// The lwIP (18) and Wi-Fi (23) tasks stay above all of these.
+static const sched_profile_t profiles[] = {
+    {
+        // The original layout: encoder and sender share core 1 at equal priority
+        .name = "balanced",
+        .roles = {
+            [SCHED_ROLE_CAMERA] = {0, 10},
+            [SCHED_ROLE_ENCODING] = {1, 5},
+            [SCHED_ROLE_STREAMING] = {1, 5},
+            [SCHED_ROLE_UART] = {0, 6},
+        },
+    },
+    {
+        // Sending preempts the Huffman task, so stripes and frames go out as soon as they are encoded
+        .name = "latency-first",
+        .roles = {
+            [SCHED_ROLE_CAMERA] = {0, 10},
+            [SCHED_ROLE_ENCODING] = {1, 6},
+            [SCHED_ROLE_STREAMING] = {1, 7},
+            [SCHED_ROLE_UART] = {0, 2},
+        },
+    },
+    {
+        // The Huffman task gets core 1 to itself, sending fills the camera task's waits on core 0
+        .name = "throughput-first",
+        .roles = {
+            [SCHED_ROLE_CAMERA] = {0, 10},
+            [SCHED_ROLE_ENCODING] = {1, 8},
+            [SCHED_ROLE_STREAMING] = {0, 7},
+            [SCHED_ROLE_UART] = {0, 2},
+        },
+    },
+};
+
+#define PROFILE_COUNT (sizeof(profiles) / sizeof(profiles[0]))
+
+#if defined(CONFIG_MIMI_SCHED_PROFILE_LATENCY)
+#define SCHED_DEFAULT_PROFILE 1
+#elif defined(CONFIG_MIMI_SCHED_PROFILE_THROUGHPUT)
+#define SCHED_DEFAULT_PROFILE 2
+#else
+#define SCHED_DEFAULT_PROFILE 0
+#endif
+
+typedef struct {
+    TaskHandle_t task;
+    sched_role_t role;
+} registered_task_t;
+
+static const sched_profile_t *current_profile = &profiles[SCHED_DEFAULT_PROFILE];
+static registered_task_t registered_tasks[SCHED_MAX_TASKS];
+static int registered_count;
+static portMUX_TYPE sched_mux = portMUX_INITIALIZER_UNLOCKED;
+
+void sched_init(void) {
+    nvs_handle_t nvs;
+    if (nvs_open(SCHED_NVS_NAMESPACE, NVS_READONLY, &nvs) == ESP_OK) {
+        char name[24];
+        size_t len = sizeof(name);
+        if (nvs_get_str(nvs, SCHED_NVS_KEY, name, &len) == ESP_OK) {
+            const sched_profile_t *profile = sched_find_profile(name);
+            if (profile != NULL) {
+                current_profile = profile;
+            } else {
+                ESP_LOGW(TAG_MIMI, "Unknown saved scheduling profile %s", name);
+            }
+        }
+        nvs_close(nvs);
+    }
+    ESP_LOGI(TAG_MIMI, "Scheduling profile %s", current_profile->name);
+}
+
+BaseType_t sched_core(const sched_role_t role) {
+    return current_profile->roles[role].core;
+}
+
+UBaseType_t sched_priority(const sched_role_t role) {
+    return current_profile->roles[role].priority;
+}
+
+const sched_profile_t *sched_get_profile(void) {
+    return current_profile;
+}
+
+const sched_profile_t *sched_find_profile(const char *name) {
+    for (size_t i = 0; i < PROFILE_COUNT; i++) {
+        if (strcmp(name, profiles[i].name) == 0) {
+            return &profiles[i];
+        }
+    }
+    return NULL;
+}
+
+void sched_list_profiles(char *buf, const size_t size, const char *separator) {
+    size_t pos = 0;
+    buf[0] = '\0';
+    for (size_t i = 0; i < PROFILE_COUNT && pos < size; i++) {
+        pos += snprintf(buf + pos, size - pos, "%s%s", i > 0 ? separator : "", profiles[i].name);
+    }
+}
+
+esp_err_t sched_set_profile(const sched_profile_t *profile) {
+    bool cores_changed = false; // The encoding role's core applies at the next encoder open
+    for (int role = 0; role < SCHED_ROLE_COUNT; role++) {
+        cores_changed |= role != SCHED_ROLE_ENCODING && profile->roles[role].core != current_profile->roles[role].core;
+    }
+    current_profile = profile;
+
+    portENTER_CRITICAL(&sched_mux);
+    const int count = registered_count;
+    portEXIT_CRITICAL(&sched_mux);
+    for (int i = 0; i < count; i++) {
+        vTaskPrioritySet(registered_tasks[i].task, profile->roles[registered_tasks[i].role].priority);
+    }
+
+    nvs_handle_t nvs;
+    esp_err_t err = nvs_open(SCHED_NVS_NAMESPACE, NVS_READWRITE, &nvs);
+    if (err == ESP_OK) {
+        err = nvs_set_str(nvs, SCHED_NVS_KEY, profile->name);
+        if (err == ESP_OK) {
+            err = nvs_commit(nvs);
+        }
+        nvs_close(nvs);
+    }
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG_MIMI, "Failed to save the scheduling profile (%s)", esp_err_to_name(err));
+    }
+    ESP_LOGI(TAG_MIMI, "Scheduling profile %s%s", profile->name,
+             cores_changed ? ", core placement from the next boot" : "");
+    return err;
+}
+
+void sched_register_task(const TaskHandle_t task, const sched_role_t role) {
+    if (task == NULL) {
+        return;
+    }
+    portENTER_CRITICAL(&sched_mux);
+    if (registered_count < SCHED_MAX_TASKS) {
+        registered_tasks[registered_count] = (registered_task_t){.task = task, .role = role};
+        registered_count++;
+    }
+    portEXIT_CRITICAL(&sched_mux);
+}
+
+int sched_get_task_stats(sched_task_stats_t *stats, const int max) {
+#if CONFIG_FREERTOS_GENERATE_RUN_TIME_STATS
+    TaskStatus_t *tasks = malloc(SCHED_MAX_STATS_TASKS * sizeof(TaskStatus_t));
+    if (tasks == NULL) {
+        return 0;
+    }
+    const int task_count = (int)uxTaskGetSystemState(tasks, SCHED_MAX_STATS_TASKS, NULL);
+    const int count = task_count < max ? task_count : max;
+    for (int i = 0; i < count; i++) {
+        sched_task_stats_t *entry = &stats[i];
+        entry->handle = tasks[i].xHandle;
+        strlcpy(entry->name, tasks[i].pcTaskName, sizeof(entry->name));
+        entry->core = tasks[i].xCoreID == tskNO_AFFINITY ? -1 : (int)tasks[i].xCoreID;
+        entry->priority = tasks[i].uxCurrentPriority;
+        entry->runtime_us = tasks[i].ulRunTimeCounter;
+    }
+    free(tasks);
+    return count;
+#else
+    return 0;
+#endif
+}
@@ -0,0 +1,80 @@
+#ifndef MIMI_SCHED_H
+#define MIMI_SCHED_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "esp_err.h"
+#include "freertos/FreeRTOS.h"
+
+#define SCHED_MAX_TASKS 12        // Registered for priority changes
+#define SCHED_MAX_STATS_TASKS 32  // Tasks reported by sched_get_task_stats()
+
+/**
+ * The task groups a scheduling profile places.
+ */
+typedef enum {
+    SCHED_ROLE_CAMERA,    // camera_task: capture, input copy, the DCT half of the encoder
+    SCHED_ROLE_ENCODING,  // Huffman task of esp_new_jpeg, dual-mode encoder tasks
+    SCHED_ROLE_STREAMING, // HTTP server, stream sender, RTP and netconn stream
+    SCHED_ROLE_UART,      // Minglish console
+    SCHED_ROLE_COUNT
+} sched_role_t;
+
+typedef struct {
+    BaseType_t core;
+    UBaseType_t priority;
+} sched_placement_t;
+
+typedef struct {
+    const char *name;
+    sched_placement_t roles[SCHED_ROLE_COUNT];
+} sched_profile_t;
+
+typedef struct {
+    TaskHandle_t handle;
+    char name[configMAX_TASK_NAME_LEN];
+    int core;             // -1: not pinned
+    UBaseType_t priority;
+    uint32_t runtime_us;  // Since boot, wraps after ~71 minutes (FreeRTOS run-time stats, esp_timer clock)
+} sched_task_stats_t;
+
+/**
+ * Selects the profile saved by sched_set_profile(), or the one chosen in menuconfig (Mimi video streaming >
+ * Scheduling profile). Call after nvs_flash_init() and before creating the pipeline tasks.
+ */
+void sched_init(void);
+
+BaseType_t sched_core(sched_role_t role);
+UBaseType_t sched_priority(sched_role_t role);
+
+const sched_profile_t *sched_get_profile(void);
+
+/**
+ * Returns NULL for an unknown name.
+ */
+const sched_profile_t *sched_find_profile(const char *name);
+
+/**
+ * Writes the profile names separated by `separator` into `buf`.
+ */
+void sched_list_profiles(char *buf, size_t size, const char *separator);
+
+/**
+ * Switches to `profile` and saves it in NVS. Registered tasks get their new priority at once; core placement
+ * takes effect at the next boot (FreeRTOS can't move a pinned task), the Huffman task's at the next encoder open.
+ */
+esp_err_t sched_set_profile(const sched_profile_t *profile);
+
+/**
+ * Registers a task to follow the priority of `role` when the profile changes.
+ */
+void sched_register_task(TaskHandle_t task, sched_role_t role);
+
+/**
+ * Fills up to `max` entries with every task's run time, returns the number filled. 0 without
+ * CONFIG_FREERTOS_GENERATE_RUN_TIME_STATS.
+ */
+int sched_get_task_stats(sched_task_stats_t *stats, int max);
+
+#endif //MIMI_SCHED_H
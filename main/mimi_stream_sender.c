@@ -0,0 +1,562 @@
+#include "mimi_stream_sender.h"
+
+#include <inttypes.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "esp_vfs_eventfd.h"
+#include "lwip/sockets.h"
+#include "mimi_common.h"
+#include "mimi_frame_bus.h"
+#include "mimi_metrics.h"
+#include "mimi_rate_control.h"
+#include "mimi_sched.h"
+#include "freertos/queue.h"
+
+#define STREAM_SENDER_TASK_STACK_SIZE 4096
+#define STREAM_SENDER_EVENT_WAKEUP 1 // 0: poll for frames every STREAM_SENDER_SELECT_TIMEOUT_MS (to compare on /metrics)
+#define STREAM_SENDER_SELECT_TIMEOUT_MS 10 // Polling: bounds how late a blocked or WebSocket client notices new frames
+#define STREAM_SENDER_IDLE_TIMEOUT_MS 1000
+
+#define WS_OPCODE_TEXT 0x1
+#define WS_OPCODE_BINARY 0x2
+#define WS_OPCODE_CLOSE 0x8
+#define WS_OPCODE_PING 0x9
+#define WS_OPCODE_PONG 0xA
+#define WS_FIN 0x80
+#define WS_MASK 0x80
+#define WS_MAX_CONTROL_PAYLOAD 125 // Longer client messages are not expected, the client is dropped
+#define WS_RTT_SLOTS 8             // Sent frames an ack is matched against for the round-trip time
+
+static const char *stream_response_header =
+    "HTTP/1.1 200 OK\r\n"
+    "Content-Type: multipart/x-mixed-replace; boundary=" STREAM_BOUNDARY "\r\n"
+    "Cache-Control: no-cache\r\n"
+    "Connection: close\r\n"
+    "\r\n";
+
+static const char *stream_busy_response =
+    "HTTP/1.1 503 Service Unavailable\r\n"
+    "Content-Type: text/plain\r\n"
+    "Content-Length: 16\r\n"
+    "Connection: close\r\n"
+    "\r\n"
+    "Too many viewers";
+
+typedef struct {
+    httpd_req_t *req;
+    bool websocket;
+    frame_bus_policy_t policy;
+} new_client_t;
+
+typedef struct {
+    uint32_t seq;             // Last frame sent
+    uint32_t acked;           // Last frame acknowledged by the client
+    uint32_t window;          // 0: no flow control
+    int64_t sent_times[WS_RTT_SLOTS];
+    int64_t rtt_us;           // Latest round-trip time, reported back in the frame messages
+    uint8_t rx[2 + 4 + WS_MAX_CONTROL_PAYLOAD]; // One client frame: header, masking key, payload
+    int rx_len;
+    uint8_t control[2 + WS_MAX_CONTROL_PAYLOAD]; // Pong or close to send once the current frame is out
+    int control_len;
+    bool closing;             // Close after the pending control frame
+} ws_state_t;
+
+typedef struct {
+    bool active;
+    httpd_req_t *req;
+    int fd;
+    frame_subscriber_t *subscriber;
+    char header[160];         // Multipart: HTTP response header. WebSocket: frame messages
+    int header_len;
+    int header_sent;
+    bool header_ready;        // WebSocket headers need the final length, i.e. a complete frame
+    jpeg_frame_t *frame;      // Frame being sent, NULL while waiting for the next one
+    int prefix_len;           // Multipart: part header in the frame's headroom, sent together with the JPEG
+    int body_sent;            // Counted from the start of the prefix
+    int64_t dequeue_time;
+    int64_t send_us;          // Time this frame spent in send() or waiting for the socket (for the rate controller)
+    int64_t blocked_since;
+    bool websocket;
+    ws_state_t ws;
+} stream_client_t;
+
+static stream_client_t clients[STREAM_SENDER_MAX_CLIENTS];
+static QueueHandle_t new_clients;
+static TaskHandle_t sender_task_handle;
+static atomic_bool drop_clients = false;
+#if STREAM_SENDER_EVENT_WAKEUP
+static int wake_fd = -1;      // eventfd the sender task selects on together with the client sockets
+#endif
+
+/**
+ * Wakes the sender task, also out of select(). Frame bus wake function and new client signal.
+ */
+static void wake_sender(void *) {
+#if STREAM_SENDER_EVENT_WAKEUP
+    const uint64_t one = 1;
+    write(wake_fd, &one, sizeof(one));
+#else
+    xTaskNotifyGive(sender_task_handle);
+#endif
+}
+
+static void close_client(stream_client_t *client) {
+    if (client->frame != NULL) {
+        jpeg_frame_release(client->frame);
+        client->frame = NULL;
+    }
+    if (client->subscriber != NULL) {
+        frame_bus_unsubscribe(client->subscriber);
+        client->subscriber = NULL;
+    }
+    const httpd_handle_t server = client->req->handle;
+    httpd_req_async_handler_complete(client->req);
+    httpd_sess_trigger_close(server, client->fd);
+    client->active = false;
+}
+
+static void accept_new_clients(void) {
+    new_client_t new_client;
+    while (xQueueReceive(new_clients, &new_client, 0) == pdTRUE) {
+        httpd_req_t *req = new_client.req;
+        stream_client_t *client = NULL;
+        for (int i = 0; i < STREAM_SENDER_MAX_CLIENTS; i++) {
+            if (!clients[i].active) {
+                client = &clients[i];
+                break;
+            }
+        }
+        frame_subscriber_t *subscriber = client != NULL ? frame_bus_subscribe() : NULL;
+        const int fd = httpd_req_to_sockfd(req);
+        if (subscriber == NULL) {
+            if (!new_client.websocket) {
+                send(fd, stream_busy_response, strlen(stream_busy_response), MSG_DONTWAIT);
+            }
+            httpd_req_async_handler_complete(req);
+            httpd_sess_trigger_close(req->handle, fd);
+            continue;
+        }
+        frame_bus_set_policy(subscriber, new_client.policy);
+#if STREAM_SENDER_EVENT_WAKEUP
+        frame_bus_set_wake(subscriber, wake_sender, NULL);
+#endif
+
+        *client = (stream_client_t){
+            .active = true,
+            .req = req,
+            .fd = fd,
+            .subscriber = subscriber,
+            .websocket = new_client.websocket,
+            .ws.window = STREAM_WS_DEFAULT_WINDOW,
+        };
+        if (!client->websocket) { // The WebSocket handshake response was sent by the HTTP server
+            client->header_len = snprintf(client->header, sizeof(client->header), "%s", stream_response_header);
+        }
+        ESP_LOGI(TAG_MIMI, "%s client connected (socket %d, policy %s)", client->websocket ? "WebSocket" : "Stream", fd,
+                 frame_bus_policy_name(new_client.policy));
+    }
+}
+
+/**
+ * Non-blocking send. Returns the number of bytes written, 0 if the socket buffer is full, -1 on error.
+ */
+static int send_some(stream_client_t *client, const void *buf, const int len) {
+    const int64_t start = esp_timer_get_time();
+    const int written = send(client->fd, buf, len, MSG_DONTWAIT);
+    const int64_t now = esp_timer_get_time();
+    client->send_us += now - start;
+    if (written >= 0) {
+        if (client->blocked_since != 0) {
+            client->send_us += start - client->blocked_since;
+            client->blocked_since = 0;
+        }
+        return written;
+    }
+    if (errno == EAGAIN || errno == EWOULDBLOCK) {
+        if (client->blocked_since == 0) {
+            client->blocked_since = now;
+        }
+        return 0;
+    }
+    return -1;
+}
+
+static int put_ws_header(uint8_t *p, const uint8_t opcode, const uint32_t len) {
+    p[0] = WS_FIN | opcode;
+    if (len < 126) {
+        p[1] = len;
+        return 2;
+    }
+    if (len <= 0xFFFF) {
+        p[1] = 126;
+        p[2] = len >> 8;
+        p[3] = len;
+        return 4;
+    }
+    p[1] = 127;
+    memset(p + 2, 0, 4);
+    p[6] = len >> 24;
+    p[7] = len >> 16;
+    p[8] = len >> 8;
+    p[9] = len;
+    return 10;
+}
+
+static void on_ws_ack(stream_client_t *client, const uint32_t seq) {
+    ws_state_t *ws = &client->ws;
+    if ((int32_t) (seq - ws->acked) <= 0 || (int32_t) (seq - ws->seq) > 0) {
+        return; // Stale or not sent yet
+    }
+    ws->acked = seq;
+    // The last frame may still be in the socket buffer, its send time is not known yet
+    if (ws->seq - seq < WS_RTT_SLOTS && !(seq == ws->seq && client->frame != NULL)) {
+        ws->rtt_us = esp_timer_get_time() - ws->sent_times[seq % WS_RTT_SLOTS];
+        metrics_record(METRIC_STAGE_WS_RTT, ws->rtt_us);
+    }
+}
+
+static void queue_ws_control(ws_state_t *ws, const uint8_t opcode, const uint8_t *payload, const int len) {
+    ws->control_len = put_ws_header(ws->control, opcode, len);
+    memcpy(ws->control + ws->control_len, payload, len);
+    ws->control_len += len;
+}
+
+static bool handle_ws_message(stream_client_t *client, const uint8_t opcode, const uint8_t *payload, const int len) {
+    switch (opcode) {
+        case WS_OPCODE_TEXT: {
+            char text[WS_MAX_CONTROL_PAYLOAD + 1];
+            memcpy(text, payload, len);
+            text[len] = '\0';
+            if (strncmp(text, "ack ", 4) == 0) {
+                on_ws_ack(client, strtoul(text + 4, NULL, 10));
+            } else if (strncmp(text, "win ", 4) == 0) {
+                client->ws.window = strtoul(text + 4, NULL, 10);
+            }
+            return true;
+        }
+        case WS_OPCODE_PING:
+            queue_ws_control(&client->ws, WS_OPCODE_PONG, payload, len);
+            return true;
+        case WS_OPCODE_CLOSE:
+            queue_ws_control(&client->ws, WS_OPCODE_CLOSE, payload, 0);
+            client->ws.closing = true;
+            return true;
+        default: // Pong, binary, continuation: nothing the client is expected to send
+            return true;
+    }
+}
+
+/**
+ * Reads and handles the messages the client has sent. Returns false if the client is gone or misbehaves.
+ */
+static bool read_ws_messages(stream_client_t *client) {
+    ws_state_t *ws = &client->ws;
+    while (true) {
+        const int received = recv(client->fd, ws->rx + ws->rx_len, sizeof(ws->rx) - ws->rx_len, MSG_DONTWAIT);
+        if (received == 0) {
+            return false;
+        }
+        if (received < 0) {
+            return errno == EAGAIN || errno == EWOULDBLOCK;
+        }
+        ws->rx_len += received;
+
+        while (ws->rx_len >= 2) {
+            const uint8_t opcode = ws->rx[0] & 0x0F;
+            const int len = ws->rx[1] & 0x7F;
+            if (!(ws->rx[1] & WS_MASK) || len > WS_MAX_CONTROL_PAYLOAD) {
+                return false;
+            }
+            const int frame_len = 2 + 4 + len;
+            if (ws->rx_len < frame_len) {
+                break;
+            }
+            uint8_t *mask = ws->rx + 2;
+            uint8_t *payload = ws->rx + 6;
+            for (int i = 0; i < len; i++) {
+                payload[i] ^= mask[i % 4];
+            }
+            if (!handle_ws_message(client, opcode, payload, len)) {
+                return false;
+            }
+            ws->rx_len -= frame_len;
+            memmove(ws->rx, ws->rx + frame_len, ws->rx_len);
+        }
+    }
+}
+
+/**
+ * Text message with the frame metadata and the header of the binary message, sent as one piece.
+ */
+static void build_ws_frame_header(stream_client_t *client) {
+    ws_state_t *ws = &client->ws;
+    const uint32_t len = client->frame->fb.len;
+    char meta[48];
+    const int meta_len = snprintf(meta, sizeof(meta), "frame %" PRIu32 " %" PRIu32 " %" PRId64,
+                                  ws->seq, len, ws->rtt_us);
+    uint8_t *p = (uint8_t *) client->header;
+    p += put_ws_header(p, WS_OPCODE_TEXT, meta_len);
+    memcpy(p, meta, meta_len);
+    p += meta_len;
+    p += put_ws_header(p, WS_OPCODE_BINARY, len);
+    client->header_len = p - (uint8_t *) client->header;
+    client->header_sent = 0;
+    client->header_ready = true;
+}
+
+/**
+ * Writes the multipart part header into the headroom right in front of the JPEG, once per frame: every stream
+ * client sends the same bytes. A frame that is still being encoded (low-latency mode) goes without Content-Length,
+ * the client finds its end by the next boundary.
+ */
+static void build_part_header(jpeg_frame_t *frame) {
+    char header[JPEG_FRAME_HEADROOM];
+    int len;
+    if (jpeg_frame_is_complete(frame)) {
+        len = snprintf(header, sizeof(header),
+                       "\r\n--" STREAM_BOUNDARY "\r\nContent-Type: image/jpeg\r\nContent-Length: %u\r\n\r\n",
+                       frame->fb.len);
+    } else {
+        len = snprintf(header, sizeof(header), "\r\n--" STREAM_BOUNDARY "\r\nContent-Type: image/jpeg\r\n\r\n");
+    }
+    memcpy(frame->fb.buf - len, header, len);
+    frame->prefix_len = len;
+}
+
+static void start_frame(stream_client_t *client, jpeg_frame_t *frame) {
+    client->frame = frame;
+    client->prefix_len = 0;
+    client->body_sent = 0;
+    client->send_us = 0;
+    client->blocked_since = 0;
+    client->dequeue_time = esp_timer_get_time();
+    metrics_record(METRIC_STAGE_QUEUE, client->dequeue_time - frame->publish_time);
+
+    if (client->websocket) {
+        client->ws.seq++;
+        client->header_len = 0;
+        client->header_sent = 0;
+        client->header_ready = false; // Built once the frame is complete
+        return;
+    }
+
+    if (frame->prefix_len == 0) {
+        build_part_header(frame);
+    }
+    client->prefix_len = frame->prefix_len;
+    client->header_ready = true;
+}
+
+static void finish_frame(stream_client_t *client) {
+    jpeg_frame_t *frame = client->frame;
+    if (frame->fb.len == 0) {
+        ESP_LOGW(TAG_MIMI, "Streamed frame failed to encode after %d bytes", client->body_sent - client->prefix_len);
+    } else {
+        const int64_t sent_time = esp_timer_get_time();
+        metrics_record(METRIC_STAGE_SEND, sent_time - client->dequeue_time);
+        metrics_record(METRIC_STAGE_TOTAL, sent_time - frame->capture_time);
+        metrics_count(METRIC_COUNTER_FRAMES_SENT);
+        rate_control_on_frame_sent((int)frame->fb.len, client->send_us);
+        if (client->websocket) {
+            client->ws.sent_times[client->ws.seq % WS_RTT_SLOTS] = sent_time;
+        }
+    }
+    jpeg_frame_release(frame);
+    client->frame = NULL;
+}
+
+/**
+ * Writes as much as the socket takes. Returns false if the client is gone, sets `blocked` if the socket is full.
+ */
+static bool service_client(stream_client_t *client, bool *blocked) {
+    if (client->websocket && !read_ws_messages(client)) {
+        return false;
+    }
+    while (true) {
+        if (client->header_sent < client->header_len) {
+            const int written = send_some(client, client->header + client->header_sent,
+                                          client->header_len - client->header_sent);
+            if (written < 0) {
+                return false;
+            }
+            client->header_sent += written;
+            if (client->header_sent < client->header_len) {
+                *blocked = true;
+                return true;
+            }
+        }
+
+        if (client->frame == NULL) {
+            ws_state_t *ws = &client->ws;
+            if (client->websocket && ws->control_len > 0) {
+                memcpy(client->header, ws->control, ws->control_len);
+                client->header_len = ws->control_len;
+                client->header_sent = 0;
+                ws->control_len = 0;
+                continue;
+            }
+            if (client->websocket && ws->closing) {
+                return false;
+            }
+            jpeg_frame_t *frame;
+            if (!frame_bus_receive(client->subscriber, &frame, 0)) {
+                return true; // Woken up by the frame bus when the next one is published
+            }
+            if (client->websocket && ws->window != 0 && ws->seq - ws->acked >= ws->window) {
+                metrics_count(METRIC_COUNTER_DROPPED_WS_WINDOW);
+                jpeg_frame_release(frame);
+                continue;
+            }
+            start_frame(client, frame);
+            continue;
+        }
+
+        if (!client->header_ready) {
+            if (!jpeg_frame_is_complete(client->frame)) {
+                return true; // Woken up by the frame bus when the next stripe is encoded
+            }
+            if (client->frame->fb.len == 0) {
+                client->ws.seq--; // Failed to encode, never announced
+                jpeg_frame_release(client->frame);
+                client->frame = NULL;
+                continue;
+            }
+            build_ws_frame_header(client);
+            continue;
+        }
+
+        const bool complete = jpeg_frame_is_complete(client->frame); // Before encoded_len: then it is final
+        const int len = client->prefix_len + atomic_load(&client->frame->encoded_len);
+        if (client->body_sent < len) {
+            const int written = send_some(client, client->frame->fb.buf - client->prefix_len + client->body_sent,
+                                          len - client->body_sent);
+            if (written < 0) {
+                return false;
+            }
+            client->body_sent += written;
+            if (client->body_sent < len) {
+                *blocked = true;
+                return true;
+            }
+        }
+        if (!complete) {
+            return true; // Woken up by the frame bus when the next stripe is encoded
+        }
+        finish_frame(client);
+    }
+}
+
+static void stream_sender_task(void *) {
+    // ReSharper disable once CppDFAEndlessLoop
+    while (true) {
+        if (atomic_exchange(&drop_clients, false)) {
+            for (int i = 0; i < STREAM_SENDER_MAX_CLIENTS; i++) {
+                if (clients[i].active) {
+                    close_client(&clients[i]);
+                }
+            }
+        }
+        accept_new_clients();
+
+        fd_set blocked_fds;
+        fd_set read_fds;
+        FD_ZERO(&blocked_fds);
+        FD_ZERO(&read_fds);
+        int max_fd = -1;
+        for (int i = 0; i < STREAM_SENDER_MAX_CLIENTS; i++) {
+            stream_client_t *client = &clients[i];
+            if (!client->active) {
+                continue;
+            }
+            bool blocked = false;
+            if (!service_client(client, &blocked)) {
+                ESP_LOGW(TAG_MIMI, "Client disconnected");
+                close_client(client);
+                continue;
+            }
+            if (blocked) {
+                FD_SET(client->fd, &blocked_fds);
+            }
+            if (client->websocket) {
+                FD_SET(client->fd, &read_fds); // Acks are timed for the round-trip time, read them right away
+            }
+            if (blocked || client->websocket) {
+                max_fd = client->fd > max_fd ? client->fd : max_fd;
+            }
+        }
+
+#if STREAM_SENDER_EVENT_WAKEUP
+        // New frames, stripes and clients arrive through wake_fd: select() returns as soon as there is work
+        FD_SET(wake_fd, &read_fds);
+        max_fd = wake_fd > max_fd ? wake_fd : max_fd;
+        struct timeval timeout = {.tv_sec = STREAM_SENDER_IDLE_TIMEOUT_MS / 1000};
+        if (select(max_fd + 1, &read_fds, &blocked_fds, NULL, &timeout) > 0 && FD_ISSET(wake_fd, &read_fds)) {
+            uint64_t count;
+            read(wake_fd, &count, sizeof(count));
+        }
+#else
+        if (max_fd >= 0) {
+            struct timeval timeout = {.tv_sec = 0, .tv_usec = STREAM_SENDER_SELECT_TIMEOUT_MS * 1000};
+            select(max_fd + 1, &read_fds, &blocked_fds, NULL, &timeout);
+        } else {
+            ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(STREAM_SENDER_IDLE_TIMEOUT_MS));
+        }
+#endif
+    }
+}
+
+esp_err_t stream_sender_start(void) {
+#if STREAM_SENDER_EVENT_WAKEUP
+    const esp_vfs_eventfd_config_t eventfd_config = ESP_VFS_EVENTD_CONFIG_DEFAULT();
+    const esp_err_t err = esp_vfs_eventfd_register(&eventfd_config);
+    if (err != ESP_OK && err != ESP_ERR_INVALID_STATE) { // Already registered is fine
+        ESP_LOGE(TAG_MIMI, "Failed to register eventfd (%s)", esp_err_to_name(err));
+        return err;
+    }
+    wake_fd = eventfd(0, 0);
+    if (wake_fd < 0) {
+        ESP_LOGE(TAG_MIMI, "Failed to create the stream sender eventfd");
+        return ESP_FAIL;
+    }
+#endif
+    new_clients = xQueueCreate(STREAM_SENDER_MAX_CLIENTS, sizeof(new_client_t));
+    if (xTaskCreatePinnedToCore(stream_sender_task, "stream_sender", STREAM_SENDER_TASK_STACK_SIZE, NULL,
+                                sched_priority(SCHED_ROLE_STREAMING), &sender_task_handle,
+                                sched_core(SCHED_ROLE_STREAMING)) != pdPASS) {
+        ESP_LOGE(TAG_MIMI, "Failed to create stream sender task");
+        return ESP_FAIL;
+    }
+    sched_register_task(sender_task_handle, SCHED_ROLE_STREAMING);
+    return ESP_OK;
+}
+
+static esp_err_t queue_new_client(httpd_req_t *req, const bool websocket, const frame_bus_policy_t policy) {
+    const new_client_t new_client = {.req = req, .websocket = websocket, .policy = policy};
+    if (xQueueSend(new_clients, &new_client, 0) != pdTRUE) {
+        return ESP_ERR_NO_MEM;
+    }
+    wake_sender(NULL);
+    return ESP_OK;
+}
+
+esp_err_t stream_sender_add_client(httpd_req_t *req, const frame_bus_policy_t policy) {
+    return queue_new_client(req, false, policy);
+}
+
+esp_err_t stream_sender_add_ws_client(httpd_req_t *req, const frame_bus_policy_t policy) {
+    return queue_new_client(req, true, policy);
+}
+
+void stream_sender_drop_clients(void) {
+    if (sender_task_handle == NULL) {
+        return;
+    }
+    ESP_LOGI(TAG_MIMI, "Dropping stream clients");
+    atomic_store(&drop_clients, true);
+    wake_sender(NULL);
+}
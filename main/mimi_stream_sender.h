@@ -0,0 +1,38 @@
+#ifndef MIMI_STREAM_SENDER_H
+#define MIMI_STREAM_SENDER_H
+
+#include "esp_http_server.h"
+#include "mimi_frame_bus.h"
+
+#define STREAM_SENDER_MAX_CLIENTS 4
+#define STREAM_BOUNDARY "123456789000000000000987654321" // multipart/x-mixed-replace, also used by the netconn stream
+#define STREAM_WS_DEFAULT_WINDOW 2 // Frames a WebSocket client may have unacknowledged until it sends "win N"
+
+/**
+ * Starts the task that sends the MJPEG stream to all /stream clients. It owns the client sockets and writes to
+ * them without blocking, so a slow client delays neither the other clients nor the HTTP server.
+ */
+esp_err_t stream_sender_start(void);
+
+/**
+ * Hands a /stream request over to the sender task. `req` must be an async request copy
+ * (httpd_req_async_handler_begin()); the sender completes it when the client goes away. `policy` decides what
+ * happens to frames the client can't keep up with.
+ */
+esp_err_t stream_sender_add_client(httpd_req_t *req, frame_bus_policy_t policy);
+
+/**
+ * Like stream_sender_add_client() for a /ws request after the WebSocket handshake. Each frame goes as a text
+ * message "frame <seq> <len> <rtt_us>" followed by the JPEG as one binary message. The client acknowledges with
+ * "ack <seq>" and may set its window with "win <n>" (0: no flow control); frames that would exceed the window are
+ * skipped for that client.
+ */
+esp_err_t stream_sender_add_ws_client(httpd_req_t *req, frame_bus_policy_t policy);
+
+/**
+ * Closes every client at the sender task's next pass, e.g. when the Wi-Fi link went down: their sockets are dead
+ * and would otherwise hold subscriptions and client slots until TCP gives up. Viewers reconnect and subscribe anew.
+ */
+void stream_sender_drop_clients(void);
+
+#endif //MIMI_STREAM_SENDER_H
@@ -9,6 +9,11 @@
 
 #include "driver/uart.h"
 
+#define UART_RX_BUFFER_SIZE 1024
+#define UART_EVENT_QUEUE_SIZE 16
+
+static QueueHandle_t uart_events;
+
 void init_uart() {
     const uart_config_t uart_config = {
         .baud_rate = 115200,
@@ -18,7 +23,7 @@ void init_uart() {
         .flow_ctrl = UART_HW_FLOWCTRL_DISABLE,
     };
     ESP_ERROR_CHECK(uart_param_config(UART_PORT, &uart_config));
-    ESP_ERROR_CHECK(uart_driver_install(UART_PORT, 1024, 0, 0, NULL, 0));
+    ESP_ERROR_CHECK(uart_driver_install(UART_PORT, UART_RX_BUFFER_SIZE, 0, UART_EVENT_QUEUE_SIZE, &uart_events, 0));
 }
 
 void uart_task(void *) {
@@ -26,20 +31,40 @@ void uart_task(void *) {
     int len = 0;
     char line[UART_BUF_SIZE];
     int line_pos = 0;
+    bool line_too_long = false;
     char mnemonic[MAX_MNEMONIC_LENGTH];
 
     // ReSharper disable once CppDFAEndlessLoop
     while (true) {
-        len = uart_read_bytes(UART_PORT, data, sizeof(data), pdMS_TO_TICKS(100));
-        if (len > 0) {
+        // The driver posts an event as soon as bytes arrive (RX FIFO threshold or the RX idle timeout), so a
+        // command is handled when its line ends instead of at the next poll
+        uart_event_t event;
+        xQueueReceive(uart_events, &event, portMAX_DELAY);
+        if (event.type == UART_FIFO_OVF || event.type == UART_BUFFER_FULL) {
+            uart_flush_input(UART_PORT);
+            xQueueReset(uart_events);
+            line_pos = 0;
+            line_too_long = false;
+            continue;
+        }
+        if (event.type != UART_DATA) {
+            continue;
+        }
+        while ((len = uart_read_bytes(UART_PORT, data, sizeof(data), 0)) > 0) { // Drain what is buffered
             for (int i = 0; i < len; ++i) {
                 const char c = data[i];
                 if (c == '\n' || c == '\r') {
-                    if (line_pos > 0) {
+                    if (line_too_long) {
+                        // Never run a truncated command: a cut-off password would be saved
+                        const char *message = "error line too long\r\n";
+                        uart_write_bytes(UART_PORT, message, strlen(message));
+                        line_too_long = false;
+                        line_pos = 0;
+                    } else if (line_pos > 0) {
                         line[line_pos] = 0;
                         unsigned int startPos = 0;
                         bool isString;
-                        startPos = extractLexeme(startPos, UART_BUF_SIZE, line, mnemonic, &isString);
+                        startPos = extractLexeme(startPos, line_pos, line, mnemonic, &isString);
                         const CommandFunc commandHandler = getCommandHandler(mnemonic);
                         if (commandHandler != NULL) {
                             commandHandler(line, startPos);
@@ -50,6 +75,8 @@ void uart_task(void *) {
                     }
                 } else if (line_pos < UART_BUF_SIZE - 1) {
                     line[line_pos++] = c;
+                } else {
+                    line_too_long = true;
                 }
             }
         }
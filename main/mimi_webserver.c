@@ -1,41 +1,290 @@
 #include "mimi_webserver.h"
 
-#include "esp_log.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
 #include "mimi_camera.h"
 #include "mimi_common.h"
+#include "mimi_frame_bus.h"
+#include "mimi_metrics.h"
+#include "mimi_netconn_stream.h"
+#include "mimi_rtp.h"
+#include "mimi_sched.h"
+#include "mimi_stream_sender.h"
+#include "mimi_wifi.h"
 
+/**
+ * Reads ?policy=latest|drop-newest|block (FRAME_BUS_DEFAULT_POLICY if absent). Returns false for an unknown one.
+ */
+static bool get_policy(httpd_req_t *req, frame_bus_policy_t *policy) {
+    char query[48];
+    char value[16];
+    *policy = FRAME_BUS_DEFAULT_POLICY;
+    if (httpd_req_get_url_query_str(req, query, sizeof(query)) != ESP_OK ||
+        httpd_query_key_value(query, "policy", value, sizeof(value)) != ESP_OK) {
+        return true;
+    }
+    return frame_bus_parse_policy(value, policy);
+}
+
+/**
+ * The stream is written by the stream sender task: the handler only hands the request over and returns,
+ * leaving the HTTP server free for other requests.
+ */
 static esp_err_t http_stream_handler(httpd_req_t *req) {
-    static const char *boundary = "\r\n--123456789000000000000987654321\r\n";
-    static const char *content_type = "image/jpeg";
+    frame_bus_policy_t policy;
+    if (!get_policy(req, &policy)) {
+        return httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "policy: latest, drop-newest or block");
+    }
+    httpd_req_t *async_req = NULL;
+    if (httpd_req_async_handler_begin(req, &async_req) != ESP_OK) {
+        return ESP_FAIL;
+    }
+    if (stream_sender_add_client(async_req, policy) != ESP_OK) {
+        httpd_req_async_handler_complete(async_req);
+        httpd_resp_set_status(req, HTTPD_503);
+        httpd_resp_sendstr(req, "Too many viewers");
+    }
+    return ESP_OK;
+}
 
-    httpd_resp_set_type(req, "multipart/x-mixed-replace; boundary=123456789000000000000987654321");
+/**
+ * Called by the HTTP server after the WebSocket handshake. From then on the stream sender task owns the socket:
+ * it sends the frames and reads the client's acks.
+ */
+static esp_err_t http_ws_handler(httpd_req_t *req) {
+    frame_bus_policy_t policy;
+    if (!get_policy(req, &policy)) {
+        return ESP_FAIL; // Closes the session
+    }
+    httpd_req_t *async_req = NULL;
+    if (httpd_req_async_handler_begin(req, &async_req) != ESP_OK) {
+        return ESP_FAIL;
+    }
+    if (stream_sender_add_ws_client(async_req, policy) != ESP_OK) {
+        httpd_req_async_handler_complete(async_req);
+        return ESP_FAIL; // Closes the session
+    }
+    return ESP_OK;
+}
 
-    while (1) {
-        jpeg_frame_t *jpeg_frame = NULL;
+/**
+ * Latest encoded frame as a single JPEG, without taking a frame from the streams. With ?quality=1..100 the next
+ * camera frame is encoded at that quality instead, as it is when the pipeline is idle (nobody streaming).
+ */
+static esp_err_t http_capture_handler(httpd_req_t *req) {
+    char query[32];
+    char value[8];
+    jpeg_frame_t *frame;
+    if (httpd_req_get_url_query_str(req, query, sizeof(query)) == ESP_OK &&
+        httpd_query_key_value(query, "quality", value, sizeof(value)) == ESP_OK) {
+        const int quality = atoi(value);
+        if (quality < 1 || quality > 100) {
+            return httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "Quality must be 1-100");
+        }
+        frame = camera_capture_still(quality, CAMERA_STILL_TIMEOUT_MS);
+    } else if (CAMERA_DEMAND_DRIVEN && frame_bus_subscriber_count() == 0) {
+        frame = camera_capture_still(0, CAMERA_STILL_TIMEOUT_MS); // Not encoding: the latest frame may be old
+    } else {
+        frame = frame_bus_get_latest();
+    }
+    if (frame == NULL) {
+        httpd_resp_set_status(req, HTTPD_503);
+        return httpd_resp_sendstr(req, "No frame available");
+    }
+
+    httpd_resp_set_type(req, "image/jpeg");
+    httpd_resp_set_hdr(req, "Content-Disposition", "inline; filename=capture.jpg");
+    httpd_resp_set_hdr(req, "Cache-Control", "no-cache");
+    const esp_err_t err = httpd_resp_send(req, (const char *) frame->fb.buf, (ssize_t) frame->fb.len);
+    jpeg_frame_release(frame);
+    return err;
+}
 
-        if (xQueueReceive(frame_queue, &jpeg_frame, pdMS_TO_TICKS(10)) == pdTRUE) {
-            char header_buf[128];
-            const int header_len = snprintf(header_buf, sizeof(header_buf),
-                                      "%sContent-Type: %s\r\nContent-Length: %u\r\n\r\n",
-                                      boundary, content_type, jpeg_frame->fb.len);
+/**
+ * Reads query parameter `key` as an integer in [min, max]. ESP_ERR_NOT_FOUND if it is missing,
+ * ESP_ERR_INVALID_ARG if it is not a number or out of range.
+ */
+static esp_err_t get_int(const char *query, const char *key, const long min, const long max, int *number) {
+    char value[8];
+    const esp_err_t err = httpd_query_key_value(query, key, value, sizeof(value));
+    if (err == ESP_ERR_NOT_FOUND) {
+        return err;
+    }
+    char *end;
+    const long parsed = err == ESP_OK ? strtol(value, &end, 10) : 0;
+    if (err != ESP_OK || end == value || *end != '\0' || parsed < min || parsed > max) {
+        return ESP_ERR_INVALID_ARG; // Including values too long for the buffer
+    }
+    *number = (int)parsed;
+    return ESP_OK;
+}
 
-            if (httpd_resp_send_chunk(req, header_buf, header_len) != ESP_OK ||
-                httpd_resp_send_chunk(req, (const char *)jpeg_frame->fb.buf, (ssize_t)jpeg_frame->fb.len) != ESP_OK) {
-                ESP_LOGW(TAG_MIMI, "Client disconnected");
-                break;
-                }
+/**
+ * /control?width=&height=&quality=&subsampling=&fps= switches the video mode (parameters left out keep their
+ * current value, quality=0: rate control). Returns the mode in effect.
+ */
+static esp_err_t http_control_handler(httpd_req_t *req) {
+    camera_video_mode_t mode;
+    camera_get_video_mode(&mode);
+    char query[128];
+    char value[8];
+    if (httpd_req_get_url_query_str(req, query, sizeof(query)) == ESP_OK) {
+        int number;
+        esp_err_t parsed = get_int(query, "width", 1, UINT16_MAX, &number);
+        if (parsed == ESP_ERR_INVALID_ARG) {
+            return httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "width: a video-mode resolution");
+        }
+        mode.width = parsed == ESP_OK ? number : mode.width;
+        parsed = get_int(query, "height", 1, UINT16_MAX, &number);
+        if (parsed == ESP_ERR_INVALID_ARG) {
+            return httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "height: a video-mode resolution");
+        }
+        mode.height = parsed == ESP_OK ? number : mode.height;
+        parsed = get_int(query, "quality", 0, 100, &number);
+        if (parsed == ESP_ERR_INVALID_ARG) {
+            return httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "quality: 0 (rate control) to 100");
+        }
+        mode.quality = parsed == ESP_OK ? number : mode.quality;
+        parsed = get_int(query, "fps", 0, CAMERA_MAX_FPS, &number);
+        if (parsed == ESP_ERR_INVALID_ARG) {
+            return httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "fps: 0 (no limit) to 60");
+        }
+        mode.max_fps = parsed == ESP_OK ? number : mode.max_fps;
+        if (httpd_query_key_value(query, "subsampling", value, sizeof(value)) == ESP_OK) {
+            if (strcmp(value, "422") == 0) {
+                mode.subsampling = JPEG_SUBSAMPLE_422;
+            } else if (strcmp(value, "420") == 0) {
+                mode.subsampling = JPEG_SUBSAMPLE_420;
+            } else if (strcmp(value, "444") == 0) {
+                mode.subsampling = JPEG_SUBSAMPLE_444;
+            } else if (strcmp(value, "gray") == 0) {
+                mode.subsampling = JPEG_SUBSAMPLE_GRAY;
+            } else {
+                return httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "subsampling: 422, 420, 444 or gray");
+            }
+        }
+        const esp_err_t err = camera_reconfigure(&mode);
+        if (err == ESP_ERR_NOT_SUPPORTED) {
+            return httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "Unsupported video mode");
+        }
+        if (err != ESP_OK) {
+            return httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, "Video mode switch failed");
         }
     }
 
-    httpd_resp_send_chunk(req, NULL, 0); // Закрыть поток
-    return ESP_OK;
+    camera_get_video_mode(&mode);
+    char description[48];
+    camera_format_video_mode(&mode, description, sizeof(description));
+    httpd_resp_set_type(req, "text/plain");
+    return httpd_resp_sendstr(req, description);
+}
+
+static esp_err_t emit_metrics_chunk(void *ctx, const char *text) {
+    return httpd_resp_sendstr_chunk(ctx, text);
+}
+
+static esp_err_t http_metrics_handler(httpd_req_t *req) {
+    httpd_resp_set_type(req, "text/plain; version=0.0.4");
+    if (metrics_write_prometheus(emit_metrics_chunk, req) != ESP_OK) {
+        return ESP_FAIL;
+    }
+    return httpd_resp_sendstr_chunk(req, NULL);
+}
+
+/**
+ * IPv4 address of the local or the remote end of a client socket (the server socket is dual-stack, IPv4 clients
+ * show up as IPv4-mapped IPv6 addresses).
+ */
+static bool get_socket_ipv4(const int fd, const bool peer, struct in_addr *addr) {
+    struct sockaddr_storage storage;
+    socklen_t len = sizeof(storage);
+    const int err = peer ? getpeername(fd, (struct sockaddr *) &storage, &len)
+                         : getsockname(fd, (struct sockaddr *) &storage, &len);
+    if (err != 0) {
+        return false;
+    }
+    if (storage.ss_family == AF_INET) {
+        *addr = ((struct sockaddr_in *) &storage)->sin_addr;
+        return true;
+    }
+    if (storage.ss_family == AF_INET6) {
+        const struct sockaddr_in6 *addr6 = (struct sockaddr_in6 *) &storage;
+        static const uint8_t v4_mapped_prefix[12] = {0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0xFF, 0xFF};
+        if (memcmp(addr6->sin6_addr.s6_addr, v4_mapped_prefix, sizeof(v4_mapped_prefix)) == 0) {
+            memcpy(&addr->s_addr, &addr6->sin6_addr.s6_addr[12], sizeof(addr->s_addr));
+            return true;
+        }
+    }
+    return false;
+}
+
+/**
+ * /rtp?port=N starts sending RTP/JPEG to port N (default RTP_DEFAULT_PORT) of the requesting host and returns
+ * the SDP to open the stream with. /rtp?stop=1 stops it.
+ */
+static esp_err_t http_rtp_handler(httpd_req_t *req) {
+    char query[32];
+    char value[8];
+    int port = RTP_DEFAULT_PORT;
+    bool stop = false;
+    if (httpd_req_get_url_query_str(req, query, sizeof(query)) == ESP_OK) {
+        if (httpd_query_key_value(query, "port", value, sizeof(value)) == ESP_OK) {
+            port = atoi(value);
+        }
+        stop = httpd_query_key_value(query, "stop", value, sizeof(value)) == ESP_OK;
+    }
+    if (stop) {
+        rtp_set_destination(NULL);
+        return httpd_resp_sendstr(req, "RTP stopped");
+    }
+    if (port <= 0 || port > 65535) {
+        return httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "Invalid port");
+    }
+
+    const int fd = httpd_req_to_sockfd(req);
+    struct in_addr local_addr;
+    struct sockaddr_in dest = {.sin_family = AF_INET, .sin_port = htons(port)};
+    if (!get_socket_ipv4(fd, false, &local_addr) || !get_socket_ipv4(fd, true, &dest.sin_addr)) {
+        return httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "IPv4 clients only");
+    }
+    if (rtp_set_destination(&dest) != ESP_OK) {
+        return httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, "RTP busy");
+    }
+
+    char local[16];
+    char remote[16];
+    inet_ntoa_r(local_addr, local, sizeof(local));
+    inet_ntoa_r(dest.sin_addr, remote, sizeof(remote));
+    char sdp[192];
+    snprintf(sdp, sizeof(sdp),
+             "v=0\r\n"
+             "o=- 0 0 IN IP4 %s\r\n"
+             "s=mimi\r\n"
+             "c=IN IP4 %s\r\n"
+             "t=0 0\r\n"
+             "m=video %d RTP/AVP 26\r\n"
+             "a=rtpmap:26 JPEG/90000\r\n",
+             local, remote, port);
+    httpd_resp_set_type(req, "application/sdp");
+    return httpd_resp_sendstr(req, sdp);
+}
+
+/**
+ * Event loop task. Clients of the lost link are gone: free their slots for the viewers that reconnect.
+ */
+static void on_link_change(const bool connected) {
+    if (!connected) {
+        stream_sender_drop_clients();
+    }
 }
 
 httpd_handle_t start_webserver() {
     const httpd_config_t config = {
-        .task_priority      = STREAMING_TASK_PRIORITY,
+        .task_priority      = sched_priority(SCHED_ROLE_STREAMING),
         .stack_size         = 4096,
-        .core_id            = STREAMING_TASK_CORE_ID,
+        .core_id            = sched_core(SCHED_ROLE_STREAMING),
         .task_caps          = (MALLOC_CAP_INTERNAL | MALLOC_CAP_8BIT),
         .server_port        = 80,
         .ctrl_port          = ESP_HTTPD_DEF_CTRL_PORT,
@@ -61,7 +310,17 @@ httpd_handle_t start_webserver() {
         .uri_match_fn = NULL
     };
     httpd_handle_t server = NULL;
+    if (stream_sender_start() != ESP_OK || rtp_start() != ESP_OK) {
+        return NULL;
+    }
+    wifi_set_link_callback(on_link_change);
+#if NETCONN_STREAM_ENABLED
+    if (netconn_stream_start() != ESP_OK) {
+        return NULL;
+    }
+#endif
     if (httpd_start(&server, &config) == ESP_OK) {
+        sched_register_task(xTaskGetHandle("httpd"), SCHED_ROLE_STREAMING);
         const httpd_uri_t stream_uri = {
             .uri       = "/stream",
             .method    = HTTP_GET,
@@ -69,6 +328,48 @@ httpd_handle_t start_webserver() {
             .user_ctx  = NULL
         };
         httpd_register_uri_handler(server, &stream_uri);
+
+        const httpd_uri_t ws_uri = {
+            .uri       = "/ws",
+            .method    = HTTP_GET,
+            .handler   = http_ws_handler,
+            .user_ctx  = NULL,
+            .is_websocket = true,
+            .handle_ws_control_frames = true // Never called for them: the stream sender reads the socket
+        };
+        httpd_register_uri_handler(server, &ws_uri);
+
+        const httpd_uri_t capture_uri = {
+            .uri       = "/capture",
+            .method    = HTTP_GET,
+            .handler   = http_capture_handler,
+            .user_ctx  = NULL
+        };
+        httpd_register_uri_handler(server, &capture_uri);
+
+        const httpd_uri_t control_uri = {
+            .uri       = "/control",
+            .method    = HTTP_GET,
+            .handler   = http_control_handler,
+            .user_ctx  = NULL
+        };
+        httpd_register_uri_handler(server, &control_uri);
+
+        const httpd_uri_t metrics_uri = {
+            .uri       = "/metrics",
+            .method    = HTTP_GET,
+            .handler   = http_metrics_handler,
+            .user_ctx  = NULL
+        };
+        httpd_register_uri_handler(server, &metrics_uri);
+
+        const httpd_uri_t rtp_uri = {
+            .uri       = "/rtp",
+            .method    = HTTP_GET,
+            .handler   = http_rtp_handler,
+            .user_ctx  = NULL
+        };
+        httpd_register_uri_handler(server, &rtp_uri);
     }
     return server;
 }
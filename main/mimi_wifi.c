@@ -1,23 +1,97 @@
 #include "mimi_wifi.h"
 
+#include <inttypes.h>
+#include <stdio.h>
+#include <string.h>
+
 #include "mimi_common.h"
 #include "esp_err.h"
 #include "esp_event.h"
 #include "esp_log.h"
 #include "esp_netif.h"
 #include "esp_wifi.h"
+#include "esp_timer.h"
 #include "esp_wifi_default.h"
+#include "mimi_rate_control.h"
 #include "freertos/event_groups.h"
 
 static int retry_num = 0;
 static EventGroupHandle_t wifi_event_group;
+static bool got_first_ip;
+static esp_timer_handle_t reconnect_timer;
+static esp_timer_handle_t link_sample_timer;
+static wifi_link_fn link_callback;
+static portMUX_TYPE link_stats_mux = portMUX_INITIALIZER_UNLOCKED;
+static wifi_link_stats_t link_stats;
+static char current_ssid[33];
 
-#define WIFI_SSID           "Link_D65F_2.4GHz"
-#define WIFI_PASS           "27224069"
-#define WIFI_MAX_RETRY      5
+#define WIFI_MAX_RETRY      5      // Failed attempts before wifi_wait_connected() gives up, reconnecting goes on
 #define WIFI_CONNECTED_BIT  BIT0
 #define WIFI_FAIL_BIT       BIT1
 
+static void set_connected(const bool connected) {
+    portENTER_CRITICAL(&link_stats_mux);
+    link_stats.connected = connected;
+    if (connected) {
+        link_stats.reconnect_attempts = 0;
+    } else {
+        link_stats.disconnects++;
+        link_stats.rssi = 0;
+        link_stats.phy_rate_kbps = 0;
+    }
+    portEXIT_CRITICAL(&link_stats_mux);
+    if (link_callback != NULL) {
+        link_callback(connected);
+    }
+}
+
+static void schedule_reconnect(void) {
+    portENTER_CRITICAL(&link_stats_mux);
+    const uint32_t attempt = link_stats.reconnect_attempts++;
+    portEXIT_CRITICAL(&link_stats_mux);
+    uint32_t delay_ms = WIFI_RECONNECT_MIN_MS << (attempt < 8 ? attempt : 8);
+    delay_ms = delay_ms < WIFI_RECONNECT_MAX_MS ? delay_ms : WIFI_RECONNECT_MAX_MS;
+    ESP_LOGI(TAG_MIMI, "Reconnecting to the AP in %" PRIu32 " ms (attempt %" PRIu32 ")", delay_ms, attempt + 1);
+    esp_timer_stop(reconnect_timer); // Not running is fine
+    esp_timer_start_once(reconnect_timer, delay_ms * 1000ULL);
+}
+
+static void reconnect(void *) {
+    esp_wifi_connect();
+}
+
+/**
+ * The rate at which the negotiated mode tops out. ESP-IDF has no API for the rate in use, so this is the ceiling
+ * and RSSI tells how much of it is left (see rate_control_on_link_sample()).
+ */
+static uint32_t nominal_phy_rate_kbps(const wifi_ap_record_t *ap) {
+    if (ap->phy_11n) {
+        wifi_bandwidth_t bandwidth = WIFI_BW_HT20;
+        esp_wifi_get_bandwidth(WIFI_IF_STA, &bandwidth);
+        return bandwidth == WIFI_BW_HT40 && ap->second != WIFI_SECOND_CHAN_NONE ? 150000 : 72200; // MCS7, SGI
+    }
+    if (ap->phy_11g) {
+        return 54000;
+    }
+    return ap->phy_11b ? 11000 : 0;
+}
+
+static void sample_link(void *) {
+    wifi_ap_record_t ap;
+    int8_t rssi = 0;
+    uint32_t phy_rate_kbps = 0;
+    if (esp_wifi_sta_get_ap_info(&ap) == ESP_OK) {
+        phy_rate_kbps = nominal_phy_rate_kbps(&ap);
+        portENTER_CRITICAL(&link_stats_mux);
+        // Smoothed over about four samples, single readings jump by several dB
+        link_stats.rssi = link_stats.rssi == 0 ? ap.rssi : (int8_t)((3 * link_stats.rssi + ap.rssi) / 4);
+        link_stats.phy_rate_kbps = phy_rate_kbps;
+        rssi = link_stats.rssi;
+        portEXIT_CRITICAL(&link_stats_mux);
+    }
+    rate_control_on_link_sample(rssi, phy_rate_kbps);
+}
+
 static void event_handler(void*,
     // ReSharper disable once CppParameterMayBeConst
     esp_event_base_t event_base,
@@ -30,24 +104,44 @@ static void event_handler(void*,
         esp_wifi_connect();
     }
     else if (event_base == WIFI_EVENT && event_id == WIFI_EVENT_STA_DISCONNECTED) {
-        if (retry_num < WIFI_MAX_RETRY) {
-            esp_wifi_connect();
-            retry_num++;
-            ESP_LOGI(TAG_MIMI, "Retry to connect to the AP");
-        } else {
+        const wifi_event_sta_disconnected_t* event = event_data;
+        ESP_LOGW(TAG_MIMI, "Disconnected from the AP (reason %d)", event->reason);
+        if (xEventGroupClearBits(wifi_event_group, WIFI_CONNECTED_BIT) & WIFI_CONNECTED_BIT) {
+            set_connected(false);
+        }
+        if (++retry_num == WIFI_MAX_RETRY) {
             xEventGroupSetBits(wifi_event_group, WIFI_FAIL_BIT);
         }
-        ESP_LOGI(TAG_MIMI,"Connect to the AP fail");
+        schedule_reconnect();
     }
     else if (event_base == IP_EVENT && event_id == IP_EVENT_STA_GOT_IP) {
         const ip_event_got_ip_t* event = event_data;
         ESP_LOGI(TAG_MIMI, "Got IP:" IPSTR, IP2STR(&event->ip_info.ip));
+        if (!got_first_ip) {
+            got_first_ip = true;
+            boot_mark("got IP");
+        }
         retry_num = 0;
         xEventGroupSetBits(wifi_event_group, WIFI_CONNECTED_BIT);
+        set_connected(true);
+        sample_link(NULL);
     }
 }
 
-void init_wifi() {
+static esp_err_t set_sta_config(const char *ssid, const char *password) {
+    wifi_config_t wifi_config = {
+        .sta = {
+            // An empty password is an open network, which the WPA2 threshold would refuse
+            .threshold.authmode = password[0] != '\0' ? WIFI_AUTH_WPA2_PSK : WIFI_AUTH_OPEN,
+        },
+    };
+    snprintf((char *)wifi_config.sta.ssid, sizeof(wifi_config.sta.ssid), "%s", ssid);
+    snprintf((char *)wifi_config.sta.password, sizeof(wifi_config.sta.password), "%s", password);
+    snprintf(current_ssid, sizeof(current_ssid), "%s", ssid);
+    return esp_wifi_set_config(WIFI_IF_STA, &wifi_config);
+}
+
+void init_wifi(const char *ssid, const char *password) {
     ESP_ERROR_CHECK(esp_netif_init());
     ESP_ERROR_CHECK(esp_event_loop_create_default());
     esp_netif_create_default_wifi_sta();
@@ -56,52 +150,82 @@ void init_wifi() {
     ESP_ERROR_CHECK(esp_wifi_init(&cfg));
 
     wifi_event_group = xEventGroupCreate();
+    const esp_timer_create_args_t reconnect_timer_args = {.callback = reconnect, .name = "wifi_reconnect"};
+    ESP_ERROR_CHECK(esp_timer_create(&reconnect_timer_args, &reconnect_timer));
+    const esp_timer_create_args_t link_sample_timer_args = {.callback = sample_link, .name = "wifi_link"};
+    ESP_ERROR_CHECK(esp_timer_create(&link_sample_timer_args, &link_sample_timer));
 
-    esp_event_handler_instance_t instance_any_id;
-    esp_event_handler_instance_t instance_got_ip;
+    // Stay registered: association completes after init_wifi() has returned, and reconnects for as long as we run
     ESP_ERROR_CHECK(esp_event_handler_instance_register(WIFI_EVENT,
                                                         ESP_EVENT_ANY_ID,
                                                         &event_handler,
                                                         NULL,
-                                                        &instance_any_id));
+                                                        NULL));
     ESP_ERROR_CHECK(esp_event_handler_instance_register(IP_EVENT,
                                                         IP_EVENT_STA_GOT_IP,
                                                         &event_handler,
                                                         NULL,
-                                                        &instance_got_ip));
-
-    wifi_config_t wifi_config = {
-        .sta = {
-            .ssid = WIFI_SSID,
-            .password = WIFI_PASS,
-            .threshold.authmode = WIFI_AUTH_WPA2_PSK,
-        },
-    };
+                                                        NULL));
 
     ESP_ERROR_CHECK(esp_wifi_set_mode(WIFI_MODE_STA));
-    ESP_ERROR_CHECK(esp_wifi_set_config(WIFI_IF_STA, &wifi_config));
+    ESP_ERROR_CHECK(set_sta_config(ssid, password));
     ESP_ERROR_CHECK(esp_wifi_start());
     ESP_ERROR_CHECK(esp_wifi_set_ps(WIFI_PS_NONE));
-    ESP_LOGI(TAG_MIMI, "Wi-Fi init finished");
+    ESP_ERROR_CHECK(esp_timer_start_periodic(link_sample_timer, WIFI_LINK_SAMPLE_MS * 1000ULL));
+    ESP_LOGI(TAG_MIMI, "Wi-Fi init finished, associating");
+}
 
-    EventBits_t bits = xEventGroupWaitBits(wifi_event_group,
+esp_err_t wifi_set_credentials(const char *ssid, const char *password) {
+    // The station has to be idle for esp_wifi_set_config(), and is usually still trying to connect when new
+    // credentials are needed. Stopped in its backoff wait, no disconnect event follows: connect here instead.
+    const bool was_waiting = esp_timer_stop(reconnect_timer) == ESP_OK;
+    esp_wifi_disconnect();
+    portENTER_CRITICAL(&link_stats_mux);
+    link_stats.reconnect_attempts = 0;
+    portEXIT_CRITICAL(&link_stats_mux);
+    const esp_err_t err = set_sta_config(ssid, password);
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG_MIMI, "Failed to set the Wi-Fi credentials (%s)", esp_err_to_name(err));
+        if (was_waiting) {
+            schedule_reconnect(); // Keep trying with the old ones
+        }
+        return err;
+    }
+    ESP_LOGI(TAG_MIMI, "Switching to SSID %s", ssid);
+    if (was_waiting) {
+        esp_wifi_connect();
+    } // Otherwise the disconnect event schedules the reconnect, with the new credentials
+    return ESP_OK;
+}
+
+void wifi_set_link_callback(const wifi_link_fn callback) {
+    link_callback = callback;
+}
+
+void wifi_get_link_stats(wifi_link_stats_t *stats) {
+    portENTER_CRITICAL(&link_stats_mux);
+    *stats = link_stats;
+    portEXIT_CRITICAL(&link_stats_mux);
+}
+
+bool wifi_wait_connected(const TickType_t timeout) {
+    const EventBits_t bits = xEventGroupWaitBits(wifi_event_group,
             WIFI_CONNECTED_BIT | WIFI_FAIL_BIT,
             pdFALSE,
             pdFALSE,
-            portMAX_DELAY);
+            timeout);
 
     if (bits & WIFI_CONNECTED_BIT) {
-        ESP_LOGI(TAG_MIMI, "Connected to AP: %s", WIFI_SSID);
+        ESP_LOGI(TAG_MIMI, "Connected to AP: %s", current_ssid);
         wifi_ap_record_t ap_info;
         esp_wifi_sta_get_ap_info(&ap_info);
-        ESP_LOGI(TAG_MIMI, "RSSI: %d dBm\n", ap_info.rssi);
-    } else if (bits & WIFI_FAIL_BIT) {
-        ESP_LOGE(TAG_MIMI, "Failed to connect to SSID: %s", WIFI_SSID);
+        ESP_LOGI(TAG_MIMI, "RSSI: %d dBm", ap_info.rssi);
+        return true;
+    }
+    if (bits & WIFI_FAIL_BIT) {
+        ESP_LOGE(TAG_MIMI, "Failed to connect to SSID: %s", current_ssid);
     } else {
-        ESP_LOGE(TAG_MIMI, "Unexpected event");
+        ESP_LOGE(TAG_MIMI, "No Wi-Fi connection yet");
     }
-
-    ESP_ERROR_CHECK(esp_event_handler_instance_unregister(IP_EVENT, IP_EVENT_STA_GOT_IP, instance_got_ip));
-    ESP_ERROR_CHECK(esp_event_handler_instance_unregister(WIFI_EVENT, ESP_EVENT_ANY_ID, instance_any_id));
-    vEventGroupDelete(wifi_event_group);
+    return false;
 }
@@ -1,6 +1,52 @@
 #ifndef MIMI_WIFI_H
 #define MIMI_WIFI_H
 
-void init_wifi();
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "esp_err.h"
+#include "freertos/FreeRTOS.h"
+
+// Defaults until set with wifi-params (mimi_config.h)
+#define WIFI_SSID           "Link_D65F_2.4GHz"
+#define WIFI_PASS           "27224069"
+
+#define WIFI_RECONNECT_MIN_MS 250    // Backoff after a disconnect, doubling per failed attempt
+#define WIFI_RECONNECT_MAX_MS 30000
+#define WIFI_LINK_SAMPLE_MS 1000     // RSSI and PHY mode sampling period
+
+typedef struct {
+    bool connected;
+    int8_t rssi;                     // dBm, smoothed; 0 while disconnected
+    uint32_t phy_rate_kbps;          // Nominal maximum of the negotiated mode, 0 while disconnected
+    uint32_t disconnects;
+    uint32_t reconnect_attempts;     // Since the last disconnect
+} wifi_link_stats_t;
+
+/**
+ * Called from the event loop task when the station gets an IP address (true) or loses the AP (false).
+ */
+typedef void (*wifi_link_fn)(bool connected);
+
+/**
+ * Starts associating with the access point and returns right away; the connection comes up in the background.
+ * A lost connection is re-established with exponential backoff for as long as the device runs. Link samples go
+ * to the rate controller (rate_control_on_link_sample()).
+ */
+void init_wifi(const char *ssid, const char *password);
+
+/**
+ * Reconnects with new credentials. An empty password joins an open network.
+ */
+esp_err_t wifi_set_credentials(const char *ssid, const char *password);
+
+/**
+ * Waits up to `timeout` until the station has an IP address or the first WIFI_MAX_RETRY attempts failed (it keeps
+ * trying in the background). Returns true when connected.
+ */
+bool wifi_wait_connected(TickType_t timeout);
+
+void wifi_set_link_callback(wifi_link_fn callback);
+void wifi_get_link_stats(wifi_link_stats_t *stats);
 
 #endif //MIMI_WIFI_H
@@ -0,0 +1,51 @@
+#include "mimi_yuv.h"
+
+#define PIXELS_PER_GROUP 8 // 4 source words per row, 3 destination words per row
+
+bool yuv420_convertible(const int width, const int height) {
+    return width > 0 && height > 0 && width % PIXELS_PER_GROUP == 0 && height % 2 == 0;
+}
+
+/**
+ * Byte-wise average (rounded down) of four bytes at once, without carries between them (SWAR).
+ */
+static inline uint32_t average_bytes(const uint32_t a, const uint32_t b) {
+    return (a & b) + (((a ^ b) & 0xFEFEFEFE) >> 1);
+}
+
+/**
+ * Packs four 3-byte pixel pairs (Y, chroma, Y in the low three bytes) into three words.
+ */
+static inline void store_group(uint32_t *dst, const uint32_t t0, const uint32_t t1, const uint32_t t2,
+                               const uint32_t t3) {
+    dst[0] = t0 | t1 << 24;
+    dst[1] = t1 >> 8 | t2 << 16;
+    dst[2] = t2 >> 16 | t3 << 8;
+}
+
+void yuv422_to_yuv420(const uint8_t *src, const size_t src_stride, const int width, const int height,
+                      uint8_t *dst) {
+    const size_t dst_stride = (size_t)width * 3 / 2;
+    for (int y = 0; y < height; y += 2) {
+        // Little-endian words: Y0 in the low byte, then Cb, Y1 and Cr
+        const uint32_t *even = (const uint32_t *)(src + y * src_stride);
+        const uint32_t *odd = (const uint32_t *)(src + (y + 1) * src_stride);
+        uint32_t *even_out = (uint32_t *)(dst + y * dst_stride);
+        uint32_t *odd_out = (uint32_t *)(dst + (y + 1) * dst_stride);
+        for (int x = 0; x < width / 2; x += 4) {
+            uint32_t t[4];
+            uint32_t u[4];
+            for (int i = 0; i < 4; i++) {
+                const uint32_t a = even[x + i];
+                const uint32_t b = odd[x + i];
+                const uint32_t chroma = average_bytes(a, b);
+                t[i] = (a & 0x00FF00FF) | (chroma & 0x0000FF00);         // Y0 Cb Y1
+                u[i] = (b & 0x00FF00FF) | ((chroma >> 16) & 0x0000FF00); // Y0 Cr Y1
+            }
+            store_group(even_out, t[0], t[1], t[2], t[3]);
+            store_group(odd_out, u[0], u[1], u[2], u[3]);
+            even_out += 3;
+            odd_out += 3;
+        }
+    }
+}
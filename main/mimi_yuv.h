@@ -0,0 +1,21 @@
+#ifndef MIMI_YUV_H
+#define MIMI_YUV_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * True if a `width`x`height` image can be converted by yuv422_to_yuv420(): whole 8-pixel groups per row and
+ * row pairs.
+ */
+bool yuv420_convertible(int width, int height);
+
+/**
+ * Converts packed YCbYCr (4:2:2) into the encoder's packed JPEG_PIXEL_FORMAT_YCbY2YCrY2 (4:2:0): every row keeps
+ * its luma, even rows carry Cb and odd rows Cr, each the average of the row pair. `src` rows are `src_stride`
+ * bytes apart and must start 4-byte aligned, as must `dst`, which receives width * height * 3 / 2 bytes.
+ */
+void yuv422_to_yuv420(const uint8_t *src, size_t src_stride, int width, int height, uint8_t *dst);
+
+#endif //MIMI_YUV_H